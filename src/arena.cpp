@@ -0,0 +1,78 @@
+#include "arena.hpp"
+
+namespace {
+
+constexpr size_t chunkSize = 8 << 10;
+// Larger allocations would waste too much of a chunk, they are taken from the buffer directly
+constexpr size_t maxChunkAllocation = chunkSize / 8;
+constexpr size_t bufferAlignment = alignof(std::max_align_t);
+
+std::atomic<uint64_t> nextEpoch{ 1 };
+
+// The chunk of the arena this thread allocated from last
+struct Chunk {
+    uint64_t epoch{ 0 };
+    std::byte* next{ nullptr };
+    std::byte* end{ nullptr };
+};
+
+thread_local Chunk threadChunk;
+
+std::byte* alignUp(std::byte* p, size_t alignment) {
+    const auto address = reinterpret_cast<uintptr_t>(p);
+    return p + ((alignment - address % alignment) % alignment);
+}
+
+}  // namespace
+
+Arena::Arena(size_t initialSize)
+    : _buffer(std::make_unique_for_overwrite<std::byte[]>(initialSize)),
+      _bufferSize(initialSize),
+      _epoch(nextEpoch++) {
+}
+
+void Arena::release() {
+    const size_t used = _used;
+    _overflow.release();
+    if (used > _bufferSize) {
+        // Chunk tails and alignment are not counted exactly, leave some room for them
+        _bufferSize = used + used / 8;
+        _buffer = std::make_unique_for_overwrite<std::byte[]>(_bufferSize);
+    }
+    _used = 0;
+    _epoch = nextEpoch++;
+}
+
+void* Arena::do_allocate(size_t bytes, size_t alignment) {
+    if (bytes > maxChunkAllocation || alignment > bufferAlignment) {
+        return allocateShared(bytes, alignment);
+    }
+
+    auto& chunk = threadChunk;
+    if (chunk.epoch == _epoch) {
+        auto* p = alignUp(chunk.next, alignment);
+        if (p + bytes <= chunk.end) {
+            chunk.next = p + bytes;
+            return p;
+        }
+    }
+
+    auto* start = static_cast<std::byte*>(allocateShared(chunkSize, bufferAlignment));
+    chunk = Chunk{ _epoch, start + bytes, start + chunkSize };
+    return start;
+}
+
+void* Arena::allocateShared(size_t bytes, size_t alignment) {
+    if (alignment <= bufferAlignment) {
+        const auto reserved = (bytes + bufferAlignment - 1) / bufferAlignment * bufferAlignment;
+        const auto offset = _used.fetch_add(reserved);
+        if (offset + reserved <= _bufferSize) {
+            return _buffer.get() + offset;
+        }
+    } else {
+        _used += bytes + alignment;
+    }
+
+    std::lock_guard lock(_overflowLock);
+    return _overflow.allocate(bytes, alignment);
+}
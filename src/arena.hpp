@@ -0,0 +1,44 @@
+#pragma once
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <memory_resource>
+#include <mutex>
+
+// Monotonic memory for everything a single conversion allocates. Nothing is given
+// back until the arena is released or destroyed. Areas are built from several
+// threads at once, so each thread bumps through a chunk of its own, taking chunks
+// from the shared buffer without locking. Only memory beyond the buffer is locked.
+//
+// Released arenas keep their initial buffer, grown to fit everything allocated
+// before the release, so a reused arena stops going to the heap. Releasing must
+// not overlap with allocation.
+struct Arena : std::pmr::memory_resource {
+    explicit Arena(size_t initialSize = 1 << 20);
+
+    Arena(const Arena&) = delete;
+    Arena& operator=(const Arena&) = delete;
+
+    void release();
+
+   private:
+    void* do_allocate(size_t bytes, size_t alignment) override;
+    void do_deallocate(void* p, size_t bytes, size_t alignment) override {
+    }
+    bool do_is_equal(const std::pmr::memory_resource& other) const noexcept override {
+        return this == &other;
+    }
+
+    void* allocateShared(size_t bytes, size_t alignment);
+
+    std::unique_ptr<std::byte[]> _buffer;
+    size_t _bufferSize;
+    // Bytes handed out from the buffer, counting on past its end once it runs out
+    std::atomic<size_t> _used{ 0 };
+    // Tells the chunks of this arena, and of this release, from stale ones
+    uint64_t _epoch;
+
+    std::mutex _overflowLock;
+    std::pmr::monotonic_buffer_resource _overflow;
+};
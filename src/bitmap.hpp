@@ -0,0 +1,15 @@
+#pragma once
+#include <memory>
+
+#include "tigr.h"
+#include "image.hpp"
+
+using Bitmap = std::unique_ptr<Tigr, decltype(&tigrFree)>;
+
+template <typename Size>
+Bitmap toBitmap(const BasicEGAImage<Size>& image) {
+    static_assert(sizeof(TPixel) == sizeof(Pixel));
+    Bitmap bmp(tigrBitmap(image.width(), image.height()), &tigrFree);
+    image.toRGBA(std::span(reinterpret_cast<Pixel*>(bmp->pix), size_t(bmp->w * bmp->h)));
+    return bmp;
+}
@@ -0,0 +1,197 @@
+#include "cache.hpp"
+#include "hash.hpp"
+
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <random>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+namespace {
+
+constexpr uint32_t entryMagic = 0x43564353;  // "SCVC"
+// magic, version, commands, encoded size, verification, pic size
+constexpr uint32_t entryHeaderWords = 6;
+
+void appendWord(std::vector<uint8_t>& bytes, uint32_t word) {
+    for (int shift = 0; shift < 32; shift += 8) {
+        bytes.push_back(uint8_t(word >> shift));
+    }
+}
+
+uint32_t readWord(const uint8_t* bytes) {
+    return bytes[0] | bytes[1] << 8 | bytes[2] << 16 | uint32_t(bytes[3]) << 24;
+}
+
+std::optional<std::vector<uint8_t>> readEntry(const std::filesystem::path& path) {
+    std::ifstream ifs(path, std::ios::binary | std::ios::ate);
+    if (!ifs.is_open()) {
+        return std::nullopt;
+    }
+
+    std::vector<uint8_t> entry(ifs.tellg());
+    ifs.seekg(0, std::ios::beg);
+    ifs.read(reinterpret_cast<char*>(entry.data()), entry.size());
+    if (!ifs) {
+        return std::nullopt;
+    }
+
+    // Eviction goes by last use
+    std::error_code error;
+    std::filesystem::last_write_time(path, std::filesystem::file_time_type::clock::now(), error);
+
+    return entry;
+}
+
+// Written aside and renamed into place, since other threads or processes may be reading
+void writeEntry(const std::filesystem::path& path, std::span<const uint8_t> entry) {
+    auto tempPath = path;
+    tempPath += "." + std::to_string(std::random_device{}()) + ".tmp";
+    {
+        std::ofstream ofs(tempPath, std::ios::binary);
+        ofs.write(reinterpret_cast<const char*>(entry.data()), entry.size());
+        ofs.close();
+        if (!ofs) {
+            std::error_code error;
+            std::filesystem::remove(tempPath, error);
+            return;
+        }
+    }
+
+    std::error_code error;
+    std::filesystem::rename(tempPath, path, error);
+    if (error) {
+        std::filesystem::remove(tempPath, error);
+    }
+}
+
+}  // namespace
+
+ConversionCache::ConversionCache(CacheOptions options) : _options(std::move(options)) {
+    std::filesystem::create_directories(_options.dir);
+}
+
+uint64_t ConversionCache::key(const EGAImage& image, const ConvertOptions& options) {
+    Hash hash;
+    hash.add(converterVersion);
+    hash.add(options.verify);
+    hash.add(options.vectorizer.orderBudget);
+    hash.add(options.vectorizer.tiles);
+    for (int y = 0; y < image.height(); y++) {
+        hash.add(image.packedRow(y));
+    }
+    return hash.value();
+}
+
+std::filesystem::path ConversionCache::entryPath(std::string_view kind, uint64_t key) const {
+    char name[17];
+    snprintf(name, sizeof(name), "%016llx", (unsigned long long)key);
+    return _options.dir / (std::string(kind) + "-" + name);
+}
+
+std::optional<Conversion> ConversionCache::load(uint64_t key) const {
+    const auto loaded = readEntry(entryPath("pic", key));
+    if (!loaded || loaded->size() < entryHeaderWords * 4) {
+        return std::nullopt;
+    }
+    const auto& entry = *loaded;
+
+    const auto* header = entry.data();
+    const auto picSize = readWord(header + 20);
+    if (readWord(header) != entryMagic || readWord(header + 4) != converterVersion ||
+        picSize != entry.size() - entryHeaderWords * 4) {
+        return std::nullopt;
+    }
+
+    Conversion conversion;
+    conversion.report.commands = readWord(header + 8);
+    conversion.report.size = readWord(header + 12);
+    conversion.report.verification = Verification(readWord(header + 16));
+    conversion.pic.assign(entry.begin() + entryHeaderWords * 4, entry.end());
+    return conversion;
+}
+
+void ConversionCache::store(uint64_t key, const Conversion& conversion) const {
+    if (conversion.report.verification == Verification::failed) {
+        return;
+    }
+
+    std::vector<uint8_t> entry;
+    appendWord(entry, entryMagic);
+    appendWord(entry, converterVersion);
+    appendWord(entry, uint32_t(conversion.report.commands));
+    appendWord(entry, uint32_t(conversion.report.size));
+    appendWord(entry, uint32_t(conversion.report.verification));
+    appendWord(entry, uint32_t(conversion.pic.size()));
+    entry.insert(entry.end(), conversion.pic.begin(), conversion.pic.end());
+
+    writeEntry(entryPath("pic", key), entry);
+}
+
+std::optional<std::vector<uint8_t>> ConversionCache::loadStage(std::string_view stage, uint64_t key) const {
+    return readEntry(entryPath(stage, key));
+}
+
+void ConversionCache::storeStage(std::string_view stage, uint64_t key, std::span<const uint8_t> data) const {
+    writeEntry(entryPath(stage, key), data);
+}
+
+void ConversionCache::trim() const {
+    struct Entry {
+        std::filesystem::path path;
+        std::filesystem::file_time_type used;
+        uintmax_t size;
+    };
+    std::vector<Entry> entries;
+
+    const auto now = std::filesystem::file_time_type::clock::now();
+    std::error_code error;
+    for (const auto& file : std::filesystem::directory_iterator(_options.dir, error)) {
+        std::error_code fileError;
+        const auto used = file.last_write_time(fileError);
+        const auto size = file.file_size(fileError);
+        if (fileError) {
+            continue;
+        }
+        if (now - used > _options.maxAge) {
+            std::filesystem::remove(file.path(), fileError);
+            continue;
+        }
+        entries.push_back({ file.path(), used, size });
+    }
+
+    uintmax_t total = 0;
+    for (const auto& entry : entries) {
+        total += entry.size;
+    }
+    if (total <= _options.maxSize) {
+        return;
+    }
+
+    std::sort(entries.begin(), entries.end(), [](const Entry& a, const Entry& b) {
+        return a.used < b.used;
+    });
+    for (const auto& entry : entries) {
+        if (total <= _options.maxSize) {
+            break;
+        }
+        std::filesystem::remove(entry.path, error);
+        total -= entry.size;
+    }
+}
+
+std::filesystem::path defaultCacheDir() {
+    if (const char* dir = std::getenv("XDG_CACHE_HOME"); dir != nullptr && *dir != 0) {
+        return std::filesystem::path(dir) / "scivec";
+    }
+    if (const char* home = std::getenv("HOME"); home != nullptr && *home != 0) {
+        return std::filesystem::path(home) / ".cache" / "scivec";
+    }
+    if (const char* profile = std::getenv("LOCALAPPDATA"); profile != nullptr && *profile != 0) {
+        return std::filesystem::path(profile) / "scivec";
+    }
+    return std::filesystem::temp_directory_path() / "scivec";
+}
@@ -0,0 +1,46 @@
+#pragma once
+#include <chrono>
+#include <cstdint>
+#include <filesystem>
+#include <optional>
+#include <span>
+#include <string_view>
+#include <vector>
+
+#include "scivec.hpp"
+#include "stages.hpp"
+
+struct CacheOptions {
+    std::filesystem::path dir;
+    // Least recently used entries are evicted beyond this many bytes
+    uintmax_t maxSize{ uintmax_t(256) << 20 };
+    // Entries not used for this long are evicted
+    std::chrono::hours maxAge{ 24 * 30 };
+};
+
+// Conversions on disk, addressed by a hash of the EGA mapped input, the options
+// and the converter version, along with the stages they were made from. Safe to use
+// from several threads and processes.
+struct ConversionCache : StageStore {
+    explicit ConversionCache(CacheOptions options);
+
+    static uint64_t key(const EGAImage& image, const ConvertOptions& options);
+
+    std::optional<Conversion> load(uint64_t key) const;
+    // Failed conversions are not stored
+    void store(uint64_t key, const Conversion& conversion) const;
+
+    std::optional<std::vector<uint8_t>> loadStage(std::string_view stage, uint64_t key) const override;
+    void storeStage(std::string_view stage, uint64_t key, std::span<const uint8_t> data) const override;
+
+    // Evicts entries by age, then by size
+    void trim() const;
+
+   private:
+    std::filesystem::path entryPath(std::string_view kind, uint64_t key) const;
+
+    CacheOptions _options;
+};
+
+// $XDG_CACHE_HOME/scivec, falling back to ~/.cache/scivec or the temp directory
+std::filesystem::path defaultCacheDir();
@@ -0,0 +1,32 @@
+#pragma once
+#include <cstdint>
+#include <span>
+#include <string_view>
+#include <type_traits>
+
+// 64 bit FNV-1a, for telling contents apart. Not for anything adversarial.
+struct Hash {
+    Hash& add(std::span<const uint8_t> bytes) {
+        for (const auto byte : bytes) {
+            _value = (_value ^ byte) * 0x100000001b3;
+        }
+        return *this;
+    }
+
+    Hash& add(std::string_view text) {
+        return add(std::span(reinterpret_cast<const uint8_t*>(text.data()), text.size()));
+    }
+
+    template <typename T>
+        requires std::is_trivially_copyable_v<T>
+    Hash& add(const T& value) {
+        return add(std::span(reinterpret_cast<const uint8_t*>(&value), sizeof(value)));
+    }
+
+    uint64_t value() const {
+        return _value;
+    }
+
+   private:
+    uint64_t _value{ 0xcbf29ce484222325 };
+};
@@ -1,5 +1,8 @@
 #include "image.hpp"
 #include "scipic.hpp"
+#include "scipicpattern.hpp"
+#include "parallel.hpp"
+#include "kernels.hpp"
 #define STB_IMAGE_IMPLEMENTATION
 #include "stb_image.h"
 
@@ -16,78 +19,116 @@ ImageFile::ImageFile(std::string_view fileName) {
     _data.reset(image);
 }
 
-TPixel ImageFile::get(int x, int y) const {
-    const auto* p = _data.get() + (y * _width + x) * 4;
-    return TPixel{ .r = p[0], .g = p[1], .b = p[2], .a = 255 };
+ImageFile::ImageFile(std::span<const uint8_t> data) {
+    int components = 0;
+    auto* image = stbi_load_from_memory(data.data(), int(data.size()), &_width, &_height, &components, 4);
+    if (image == nullptr) {
+        throw std::runtime_error("Failed to decode image");
+    }
+    _data.reset(image);
 }
 
-std::unique_ptr<Tigr, decltype(&tigrFree)> ImageFile::asBitmap() const {
-    auto bmp = std::unique_ptr<Tigr, decltype(&tigrFree)>(tigrBitmap(_width, _height), &tigrFree);
-    const auto pixels = _width * _height;
-    std::copy((TPixel*)_data.get(), (TPixel*)_data.get() + pixels, bmp->pix);
-    return bmp;
+Pixel ImageFile::get(int x, int y) const {
+    const auto* p = _data.get() + (y * _width + x) * 4;
+    return Pixel{ .r = p[0], .g = p[1], .b = p[2], .a = 255 };
 }
 
-const std::array<const TPixel, 16> EGAImage::palette{ //
-    tigrRGB(0x00, 0x00, 0x00),
-    tigrRGB(0x00, 0x00, 0xaa),
-    tigrRGB(0x00, 0xaa, 0x00),
-    tigrRGB(0x00, 0xaa, 0xaa),
-    tigrRGB(0xaa, 0x00, 0x00),
-    tigrRGB(0xaa, 0x00, 0xaa),
-    tigrRGB(0xaa, 0x55, 0x00),
-    tigrRGB(0xaa, 0xaa, 0xaa),
-    tigrRGB(0x55, 0x55, 0x55),
-    tigrRGB(0x55, 0x55, 0xff),
-    tigrRGB(0x00, 0xff, 0x55),
-    tigrRGB(0x55, 0xff, 0xff),
-    tigrRGB(0xff, 0x55, 0x55),
-    tigrRGB(0xff, 0x55, 0xff),
-    tigrRGB(0xff, 0xff, 0x55),
-    tigrRGB(0xff, 0xff, 0xff)
+const std::array<const Pixel, 16> EGAColors::palette{ //
+    rgb(0x00, 0x00, 0x00),
+    rgb(0x00, 0x00, 0xaa),
+    rgb(0x00, 0xaa, 0x00),
+    rgb(0x00, 0xaa, 0xaa),
+    rgb(0xaa, 0x00, 0x00),
+    rgb(0xaa, 0x00, 0xaa),
+    rgb(0xaa, 0x55, 0x00),
+    rgb(0xaa, 0xaa, 0xaa),
+    rgb(0x55, 0x55, 0x55),
+    rgb(0x55, 0x55, 0xff),
+    rgb(0x00, 0xff, 0x55),
+    rgb(0x55, 0xff, 0xff),
+    rgb(0xff, 0x55, 0x55),
+    rgb(0xff, 0x55, 0xff),
+    rgb(0xff, 0xff, 0x55),
+    rgb(0xff, 0xff, 0xff)
 };
 
-int pixelDistance(const TPixel& a, const TPixel& b) {
-    return std::abs(a.r - b.r) + std::abs(a.g - b.g) + std::abs(a.b - b.b);
+template <typename Size>
+BasicEGAImage<Size>::BasicEGAImage(int w, int h, const RGBAView& image) : BasicNibbleImage<Size>(w, h) {
+    const int width = std::min(this->width(), image.width);
+    const int height = std::min(this->height(), image.height);
+    const int stripHeight = 16;
+    const int strips = (height + stripHeight - 1) / stripHeight;
+
+    // Strips hold whole rows, and rows whole bytes, so strips can be written concurrently
+    parallelFor(strips, [&](size_t strip) {
+        const int top = int(strip) * stripHeight;
+        const int bottom = std::min(top + stripHeight, height);
+        std::vector<uint8_t> indices(width);
+        for (int y = top; y < bottom; y++) {
+            quantizePixels(std::span(image.pixels + y * image.stride, width), indices, palette);
+            for (int x = 0; x < width; x++) {
+                this->put(x, y, indices[x]);
+            }
+        }
+    });
 }
 
-int egaColor(const TPixel& pixel) {
-    int minDistance = 100000;
-    int minIndex = -1;
+template <typename Size>
+void BasicEGAImage<Size>::toRGBA(std::span<Pixel> pixels) const {
+    const int width = this->width();
+    assert(pixels.size() >= size_t(width * this->height()));
+    for (int y = 0; y < this->height(); y++) {
+        expandPacked(this->packedRow(y), pixels.subspan(y * width, width), palette);
+    }
+}
 
-    for (int i = 0; auto& candidate : EGAImage::palette) {
-        const auto distance = pixelDistance(pixel, candidate);
-        if (distance < minDistance) {
-            minDistance = distance;
-            minIndex = i;
-        }
-        i++;
+template <typename Size>
+void BasicNibbleImage<Size>::fillSpan(int x0, int x1, int y, uint8_t even, uint8_t odd) {
+    assert(x0 <= x1);
+    if ((x0 & 1) != 0) {
+        put(x0++, y, odd);
+    }
+    if ((x1 & 1) == 0 && x1 >= x0) {
+        put(x1--, y, even);
     }
+    if (x0 < x1) {
+        auto* first = _bitmap.data() + y * stride() + x0 / 2;
+        fillBytes(std::span(first, (x1 - x0 + 1) / 2), even | (odd << 4));
+    }
+}
+
+template <typename Size>
+void BasicNibbleImage<Size>::copyFrom(const BasicNibbleImage& other) {
+    assert(other.width() == width());
+    assert(other.height() == height());
+    std::copy(other._bitmap.begin(), other._bitmap.end(), _bitmap.begin());
+}
 
-    return minIndex;
+template <typename Size>
+void BasicNibbleImage<Size>::expandRow(int y, std::span<uint8_t> pixels) const {
+    assert(pixels.size() >= size_t(width()));
+    unpackNibbles(packedRow(y), pixels.first(width()));
 }
 
-EGAImage::EGAImage(Tigr& bmp) : _width(bmp.w), _height(bmp.h), _bitmap(bmp.w * bmp.h) {
-    for (int x = 0; x < bmp.w; x++) {
-        for (int y = 0; y < bmp.h; y++) {
-            const auto c = egaColor(tigrGet(&bmp, x, y));
-            _bitmap[y * _width + x] = c;
-        }
+template <typename Size>
+bool BasicNibbleImage<Size>::operator==(const BasicNibbleImage& other) const {
+    if (width() != other.width() || height() != other.height()) {
+        return false;
     }
-}
 
-std::unique_ptr<Tigr, decltype(&tigrFree)> EGAImage::asBitmap() const {
-    auto bmp = std::unique_ptr<Tigr, decltype(&tigrFree)>(tigrBitmap(_width, _height), &tigrFree);
-    const auto pixels = _width * _height;
-    for (auto i = 0; i < pixels; i++) {
-        bmp->pix[i] = palette[_bitmap[i]];
+    // Whole bytes first, an odd width leaves an unused nibble at the end of each row
+    const int pairs = width() / 2;
+
+    for (int y = 0; y < height(); y++) {
+        if (!equalBytes(packedRow(y).first(pairs), other.packedRow(y).first(pairs))) {
+            return false;
+        }
+        if ((width() & 1) != 0 && get(width() - 1, y) != other.get(width() - 1, y)) {
+            return false;
+        }
     }
-    return bmp;
-}
 
-std::span<const uint8_t> EGAImage::row(int y) const {
-    assert(y < _height);
-    return std::span(_bitmap.data() + _width * y, _width);
+    return true;
 }
 
 int missingColors(std::vector<PaletteColor>& colors) {
@@ -116,7 +157,8 @@ int missingColors(std::vector<PaletteColor>& colors) {
     return missingFirstColors.size() + missingSecondColors.size();
 }
 
-Palette buildPalette(const EGAImage& bmp) {
+template <typename Size>
+Palette buildPalette(const BasicEGAImage<Size>& bmp) {
     std::unordered_set<PaletteColor, ColorHash> colors;
     std::unordered_map<PaletteColor, int, ColorHash> colorCount;
 
@@ -174,112 +216,71 @@ Palette buildPalette(const EGAImage& bmp) {
     return Palette(palette);
 }
 
-void ByteImage::copyFrom(const ByteImage& other) {
+template <typename Size>
+void BasicByteImage<Size>::copyFrom(const BasicByteImage& other) {
     assert(other.width() == width());
     assert(other.height() == height());
     std::copy(other._bitmap.begin(), other._bitmap.end(), _bitmap.begin());
 }
 
-bool PaletteImage::fillWhere(int x,
-    int y,
-    uint8_t colorIndex,
-    uint8_t bgColorValue,
-    std::function<bool(int, int)> condition) {
-    if (get(x, y) != bgColorValue) {
-        return true;
-    }
+template <typename Size>
+void BasicPaletteImage<Size>::put(int x, int y, uint8_t colorIndex) {
     const auto& color = _palette.get(colorIndex);
-    if (color.first == bgColorValue || color.second == bgColorValue) {
-        return false;
-    }
-
-    std::vector<Point> fills;
-    std::set<std::pair<int, int>> filled;
-
-    const auto check = [this, &fills, &filled, &color, &colorIndex, &bgColorValue](int x, int y) {
-        if (x < 0 || x >= width() || y < 0 || y >= height()) {
-            return;
-        }
-
-        if (filled.contains({ x, y })) {
-            return;
-        }
-
-        if (get(x, y) == bgColorValue) {
-            fills.push_back({ x, y });
-        }
-        filled.insert({ x, y });
-    };
-
-    check(x, y);
+    const auto ec = effectiveColor(color, x, y);
+    BasicNibbleImage<Size>::put(x, y, ec);
+}
 
-    if (fills.empty()) {
-        return false;
+template <typename Size>
+void BasicPaletteImage<Size>::line(int x0, int y0, int x1, int y1, uint8_t colorIndex) {
+    if (y0 == y1) {
+        const auto& color = _palette.get(colorIndex);
+        this->fillSpan(std::min(x0, x1), std::max(x0, x1), y0, effectiveColor(color, 0, y0), effectiveColor(color, 1, y0));
+        return;
     }
 
-    while (!fills.empty()) {
-        const auto& fill = fills.back();
-        int x = fill.x;
-        int y = fill.y;
-        fills.pop_back();
-        if (!condition(x, y)) {
-            return false;
-        }
+    plotLine(x0, y0, x1, y1, [&](int x, int y) {
         put(x, y, colorIndex);
-
-        check(x + 1, y);
-        check(x - 1, y);
-        check(x, y + 1);
-        check(x, y - 1);
-        if (fills.size() > 32768) {
-            throw std::runtime_error("Fill stack overflow");
-        }
-    }
-    return true;
+    });
 }
 
-void PaletteImage::put(int x, int y, uint8_t colorIndex) {
-    const auto& color = _palette.get(colorIndex);
-    const auto ec = effectiveColor(color, x, y);
-    ByteImage::put(x, y, ec);
+template <typename Size>
+void BasicPaletteImage<Size>::pattern(int x, int y, uint8_t patternFlags, uint8_t colorIndex) {
+    plotPattern(x, y, patternFlags, this->width(), this->height(), [&](int px, int py) {
+        put(px, py, colorIndex);
+    });
 }
 
-void PaletteImage::line(int x0, int y0, int x1, int y1, uint8_t colorIndex) {
-    int dx = std::abs(x1 - x0);
-    int sx = x0 < x1 ? 1 : -1;
-    int dy = -std::abs(y1 - y0);
-    int sy = y0 < y1 ? 1 : -1;
-    int err = dx + dy;
-
-    while (true) {
-        put(x0, y0, colorIndex);
-
-        if (x0 == x1 && y0 == y1)
-            break;
-
-        int e2 = 2 * err;
-
-        if (e2 >= dy) {
-            err += dy;
-            x0 += sx;
-        }
-
-        if (e2 <= dx) {
-            err += dx;
-            y0 += sy;
-        }
+template <typename Size>
+void BasicByteImage<Size>::toRGBA(std::span<Pixel> pixels, const Palette& palette) const {
+    const int width = this->width();
+    const int height = this->height();
+    assert(pixels.size() >= size_t(width * height));
+
+    // Effective colors of every palette entry, for pixels where x + y is even and odd
+    std::array<std::array<uint8_t, 256>, 2> dithered{};
+    for (size_t i = 0; i < palette.size(); i++) {
+        dithered[0][i] = effectiveColor(palette.get(i), 0, 0);
+        dithered[1][i] = effectiveColor(palette.get(i), 1, 0);
     }
-}
 
-std::unique_ptr<Tigr, decltype(&tigrFree)> ByteImage::asBitmap(Palette& palette) const {
-    auto bmp = std::unique_ptr<Tigr, decltype(&tigrFree)>(tigrBitmap(_width, _height), &tigrFree);
-    for (auto y = 0; y < _height; y++) {
-        for (auto x = 0; x < _width; x++) {
-            const auto i = y * _width + x;
-            const auto& sci = palette.get(_bitmap[i]);
-            const auto& ega = effectiveColor(sci, x, y);
-            bmp->pix[i] = EGAImage::palette[ega];
+    std::vector<uint8_t> ega(width);
+    for (auto y = 0; y < height; y++) {
+        const auto* indices = _bitmap.data() + y * width;
+        for (auto x = 0; x < width; x++) {
+            ega[x] = dithered[(x + y) & 1][indices[x]];
         }
+        expandIndices(ega, pixels.subspan(y * width, width), EGAColors::palette);
     }
-    return bmp;
 }
+
+template struct BasicNibbleImage<PicExtent>;
+template struct BasicNibbleImage<DynamicExtent>;
+template struct BasicEGAImage<PicExtent>;
+template struct BasicEGAImage<DynamicExtent>;
+template struct BasicByteImage<PicExtent>;
+template struct BasicByteImage<DynamicExtent>;
+template struct BasicPaletteImage<PicExtent>;
+template struct BasicPaletteImage<DynamicExtent>;
+
+template Palette buildPalette(const EGAImage& img);
+template Palette buildPalette(const DynamicEGAImage& img);
@@ -4,14 +4,20 @@
 #include <vector>
 #include <span>
 #include <cassert>
+#include <array>
+#include <algorithm>
 #include <functional>
+#include <stdexcept>
+#include <cstdlib>
 
 #include "stb_image.h"
-#include "tigr.h"
+#include "pixel.hpp"
 #include "palette.hpp"
 
 struct ImageFile {
     ImageFile(std::string_view fileName);
+    // Decodes an image file already in memory
+    ImageFile(std::span<const uint8_t> data);
 
     int width() const {
         return _width;
@@ -21,9 +27,11 @@ struct ImageFile {
         return _height;
     }
 
-    TPixel get(int x, int y) const;
+    Pixel get(int x, int y) const;
 
-    std::unique_ptr<Tigr, decltype(&tigrFree)> asBitmap() const;
+    RGBAView view() const {
+        return { reinterpret_cast<const Pixel*>(_data.get()), _width, _height, _width };
+    }
 
    private:
     std::unique_ptr<stbi_uc, decltype(&stbi_image_free)> _data{ nullptr, &stbi_image_free };
@@ -31,11 +39,41 @@ struct ImageFile {
     int _height{ 0 };
 };
 
-struct EGAImage {
-    static const std::array<const TPixel, 16> palette;
+// SCI0 pictures are always this size
+constexpr int picWidth = 320;
+constexpr int picHeight = 190;
+
+constexpr int dynamicExtent = -1;
+
+// Image dimensions, fixed at compile time or, with dynamicExtent, given at runtime
+template <int Width, int Height>
+struct Extent {
+    static constexpr bool fixed = true;
+
+    constexpr Extent(int width, int height) {
+        if (width != Width || height != Height) {
+            throw std::runtime_error("Image size does not match its fixed extent");
+        }
+    }
+
+    static constexpr int width() {
+        return Width;
+    }
 
-    EGAImage(Tigr& bitmap);
-    EGAImage(int w, int h) : _width(w), _height(h), _bitmap(w * h) {
+    static constexpr int height() {
+        return Height;
+    }
+
+   protected:
+    void swap(Extent&) {
+    }
+};
+
+template <>
+struct Extent<dynamicExtent, dynamicExtent> {
+    static constexpr bool fixed = false;
+
+    Extent(int width, int height) : _width(width), _height(height) {
     }
 
     int width() const {
@@ -46,93 +84,214 @@ struct EGAImage {
         return _height;
     }
 
+   protected:
+    void swap(Extent& other) {
+        std::swap(_width, other._width);
+        std::swap(_height, other._height);
+    }
+
+   private:
+    int _width;
+    int _height;
+};
+
+using PicExtent = Extent<picWidth, picHeight>;
+using DynamicExtent = Extent<dynamicExtent, dynamicExtent>;
+
+// Pixel bytes, held in a fixed array when the image size is fixed
+template <typename Size, int PixelsPerByte>
+struct ImageBytes {
+    using type = std::array<uint8_t, (Size::width() + PixelsPerByte - 1) / PixelsPerByte * Size::height()>;
+};
+
+template <int PixelsPerByte>
+struct ImageBytes<DynamicExtent, PixelsPerByte> {
+    using type = std::vector<uint8_t>;
+};
+
+// 16 color image, packed two pixels to a byte with the left pixel in the low nibble.
+// Rows start on byte boundaries.
+template <typename Size>
+struct BasicNibbleImage : Size {
+    BasicNibbleImage(int width, int height) : Size(width, height) {
+        if constexpr (!Size::fixed) {
+            _bitmap.resize(stride() * height);
+        }
+    }
+
+    using Size::height;
+    using Size::width;
+
+    int stride() const {
+        return (width() + 1) / 2;
+    }
+
     uint8_t get(int x, int y) const {
-        const auto index = y * _width + x;
+        const auto index = y * stride() + x / 2;
         assert(index < _bitmap.size());
-        return _bitmap[index];
+        const auto pair = _bitmap[index];
+        return (x & 1) != 0 ? pair >> 4 : pair & 0x0f;
     }
 
     void put(int x, int y, uint8_t p) {
         assert(p < 16);
-        const auto index = y * _width + x;
+        const auto index = y * stride() + x / 2;
         assert(index < _bitmap.size());
-        _bitmap[index] = p;
+        auto& pair = _bitmap[index];
+        pair = (x & 1) != 0 ? (pair & 0x0f) | (p << 4) : (pair & 0xf0) | p;
     }
 
-    void clear(uint8_t color) {
-        assert(color < 16);
-        std::fill(_bitmap.begin(), _bitmap.end(), color);
+    // Writes x0..x1 inclusive on row y, with even and odd columns in their own colors
+    void fillSpan(int x0, int x1, int y, uint8_t even, uint8_t odd);
+
+    void clear(uint8_t p) {
+        assert(p < 16);
+        std::fill(_bitmap.begin(), _bitmap.end(), p * 0x11);
     }
 
-    std::span<const uint8_t> row(int y) const;
+    void swap(BasicNibbleImage& other) {
+        Size::swap(other);
+        std::swap(_bitmap, other._bitmap);
+    }
+
+    void copyFrom(const BasicNibbleImage& other);
+
+    // One byte per pixel of row y
+    void expandRow(int y, std::span<uint8_t> pixels) const;
 
-    std::unique_ptr<Tigr, decltype(&tigrFree)> asBitmap() const;
+    std::span<const uint8_t> packedRow(int y) const {
+        assert(y < height());
+        return std::span(_bitmap.data() + stride() * y, stride());
+    }
+
+    bool operator==(const BasicNibbleImage& other) const;
 
    private:
-    int _width{ 0 };
-    int _height{ 0 };
-    std::vector<uint8_t> _bitmap;
+    typename ImageBytes<Size, 2>::type _bitmap{};
 };
 
-Palette buildPalette(const EGAImage& img);
-
-struct ByteImage {
-    ByteImage(int width, int height) : _width{ width }, _height{ height }, _bitmap(width * height){};
-    ByteImage(const ByteImage& other) = default;
+struct EGAColors {
+    static const std::array<const Pixel, 16> palette;
+};
 
-    void swap(ByteImage& other) {
-        std::swap(_width, other._width);
-        std::swap(_height, other._height);
-        std::swap(_bitmap, other._bitmap);
+template <typename Size>
+struct BasicEGAImage : public BasicNibbleImage<Size>, EGAColors {
+    // Maps the upper left pixels of the image to EGA colors, padding with black
+    BasicEGAImage(int w, int h, const RGBAView& image);
+    BasicEGAImage(int w, int h) : BasicNibbleImage<Size>(w, h) {
     }
 
-    int width() const {
-        return _width;
+    // Expands to RGBA, row by row
+    void toRGBA(std::span<Pixel> pixels) const;
+};
+
+template <typename Size>
+Palette buildPalette(const BasicEGAImage<Size>& img);
+
+template <typename Size>
+struct BasicByteImage : Size {
+    BasicByteImage(int width, int height) : Size(width, height) {
+        if constexpr (!Size::fixed) {
+            _bitmap.resize(width * height);
+        }
     }
 
-    int height() const {
-        return _height;
+    using Size::height;
+    using Size::width;
+
+    void swap(BasicByteImage& other) {
+        Size::swap(other);
+        std::swap(_bitmap, other._bitmap);
     }
 
     uint8_t get(int x, int y) const {
-        const auto index = y * _width + x;
+        const auto index = y * width() + x;
         assert(index < _bitmap.size());
         return _bitmap[index];
     }
 
     void put(int x, int y, uint8_t p) {
-        const auto index = y * _width + x;
+        const auto index = y * width() + x;
         assert(index < _bitmap.size());
         _bitmap[index] = p;
     }
 
     std::span<const uint8_t> row(int y) const {
-        assert(y < _height);
-        return std::span(_bitmap.data() + _width * y, _width);
+        assert(y < height());
+        return std::span(_bitmap.data() + width() * y, width());
     }
 
     void clear(uint8_t color) {
         std::fill(_bitmap.begin(), _bitmap.end(), color);
     }
 
-    void copyFrom(const ByteImage& other);
+    void copyFrom(const BasicByteImage& other);
 
-    std::unique_ptr<Tigr, decltype(&tigrFree)> asBitmap(Palette& palette) const;
+    // Expands the palette indices to RGBA, row by row, dithering as drawn
+    void toRGBA(std::span<Pixel> pixels, const Palette& palette) const;
 
    private:
-    int _width;
-    int _height;
-    std::vector<uint8_t> _bitmap;
+    typename ImageBytes<Size, 1>::type _bitmap{};
 };
 
-struct PaletteImage : public ByteImage {
-    PaletteImage(int width, int height, const Palette& palette) : ByteImage(width, height), _palette(palette) {
+// Calls plot(x, y) for the pixels of a line, in the order they are drawn
+template <typename Plot>
+void plotLine(int x0, int y0, int x1, int y1, const Plot& plot) {
+    int dx = std::abs(x1 - x0);
+    int sx = x0 < x1 ? 1 : -1;
+    int dy = -std::abs(y1 - y0);
+    int sy = y0 < y1 ? 1 : -1;
+    int err = dx + dy;
+
+    while (true) {
+        plot(x0, y0);
+
+        if (x0 == x1 && y0 == y1)
+            break;
+
+        int e2 = 2 * err;
+
+        if (e2 >= dy) {
+            err += dy;
+            x0 += sx;
+        }
+
+        if (e2 <= dx) {
+            err += dx;
+            y0 += sy;
+        }
+    }
+}
+
+template <typename Size>
+struct BasicPaletteImage : public BasicNibbleImage<Size> {
+    BasicPaletteImage(int width, int height, const Palette& palette)
+        : BasicNibbleImage<Size>(width, height), _palette(palette) {
+    }
+
+    const Palette& palette() const {
+        return _palette;
     }
 
     void put(int x, int y, uint8_t colorIndex);
-    bool fillWhere(int x, int y, uint8_t colorIndex, uint8_t bgColorValue, std::function<bool(int, int)> condition);
+    // Writes an EGA color, bypassing the palette
+    void putEGA(int x, int y, uint8_t color) {
+        BasicNibbleImage<Size>::put(x, y, color);
+    }
     void line(int x0, int y0, int x1, int y1, uint8_t colorIndex);
+    void pattern(int x, int y, uint8_t patternFlags, uint8_t colorIndex);
 
    private:
     const Palette& _palette;
 };
+
+// Images of the fixed SCI0 picture size, and of any size for viewing and testing
+using NibbleImage = BasicNibbleImage<PicExtent>;
+using EGAImage = BasicEGAImage<PicExtent>;
+using ByteImage = BasicByteImage<PicExtent>;
+using PaletteImage = BasicPaletteImage<PicExtent>;
+
+using DynamicNibbleImage = BasicNibbleImage<DynamicExtent>;
+using DynamicEGAImage = BasicEGAImage<DynamicExtent>;
+using DynamicByteImage = BasicByteImage<DynamicExtent>;
+using DynamicPaletteImage = BasicPaletteImage<DynamicExtent>;
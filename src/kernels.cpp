@@ -0,0 +1,764 @@
+#include "kernels.hpp"
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <cassert>
+#include <climits>
+#include <cstdio>
+#include <cstring>
+#include <random>
+#include <stdexcept>
+#include <vector>
+
+#if (defined(__x86_64__) || defined(__i386__)) && defined(__GNUC__)
+#define SCIVEC_X86_DISPATCH
+#include <immintrin.h>
+#endif
+
+namespace {
+
+struct Kernels {
+    void (*expandIndices)(const uint8_t* indices, size_t count, const Pixel* palette, Pixel* pixels);
+    void (*expandPacked)(const uint8_t* packed, size_t count, const Pixel* palette, Pixel* pixels);
+    void (*unpackNibbles)(const uint8_t* packed, size_t count, uint8_t* indices);
+    void (*quantizePixels)(const Pixel* pixels, size_t count, const Pixel* palette, uint8_t* indices);
+    void (*markRunStarts)(const uint8_t* row, size_t count, uint64_t* starts);
+    void (*markEqualBytes)(const uint8_t* a, const uint8_t* b, size_t count, uint64_t* equal);
+    bool (*equalBytes)(const uint8_t* a, const uint8_t* b, size_t count);
+    void (*fillBytes)(uint8_t* bytes, size_t count, uint8_t value);
+};
+
+// Scalar reference versions
+
+void expandIndicesScalar(const uint8_t* indices, size_t count, const Pixel* palette, Pixel* pixels) {
+    for (size_t i = 0; i < count; i++) {
+        pixels[i] = palette[indices[i] & 0x0f];
+    }
+}
+
+void expandPackedScalar(const uint8_t* packed, size_t count, const Pixel* palette, Pixel* pixels) {
+    for (size_t i = 0; i < count; i++) {
+        const auto pair = packed[i / 2];
+        pixels[i] = palette[(i & 1) != 0 ? pair >> 4 : pair & 0x0f];
+    }
+}
+
+void unpackNibblesScalar(const uint8_t* packed, size_t count, uint8_t* indices) {
+    for (size_t i = 0; i < count; i++) {
+        const auto pair = packed[i / 2];
+        indices[i] = (i & 1) != 0 ? pair >> 4 : pair & 0x0f;
+    }
+}
+
+void quantizePixelsScalar(const Pixel* pixels, size_t count, const Pixel* palette, uint8_t* indices) {
+    for (size_t i = 0; i < count; i++) {
+        const auto& pixel = pixels[i];
+        int minDistance = INT_MAX;
+        uint8_t minIndex = 0;
+
+        for (uint8_t c = 0; c < 16; c++) {
+            const auto& candidate = palette[c];
+            const auto distance =
+                std::abs(pixel.r - candidate.r) + std::abs(pixel.g - candidate.g) + std::abs(pixel.b - candidate.b);
+            if (distance < minDistance) {
+                minDistance = distance;
+                minIndex = c;
+            }
+        }
+
+        indices[i] = minIndex;
+    }
+}
+
+constexpr size_t maskWords(size_t count) {
+    return (count + 63) / 64;
+}
+
+// Ors in the bits for pixels at, and following, the given position
+void markBits(uint64_t* mask, size_t position, uint64_t bits) {
+    const auto shift = position % 64;
+    mask[position / 64] |= bits << shift;
+    if (shift != 0 && (bits >> (64 - shift)) != 0) {
+        mask[position / 64 + 1] |= bits >> (64 - shift);
+    }
+}
+
+void markRunStartsFrom(const uint8_t* row, size_t from, size_t count, uint64_t* starts) {
+    for (size_t i = from; i < count; i++) {
+        if (i == 0 || row[i] != row[i - 1]) {
+            markBits(starts, i, 1);
+        }
+    }
+}
+
+void markEqualBytesFrom(const uint8_t* a, const uint8_t* b, size_t from, size_t count, uint64_t* equal) {
+    for (size_t i = from; i < count; i++) {
+        if (a[i] == b[i]) {
+            markBits(equal, i, 1);
+        }
+    }
+}
+
+void markRunStartsScalar(const uint8_t* row, size_t count, uint64_t* starts) {
+    std::fill(starts, starts + maskWords(count), 0);
+    markRunStartsFrom(row, 0, count, starts);
+}
+
+void markEqualBytesScalar(const uint8_t* a, const uint8_t* b, size_t count, uint64_t* equal) {
+    std::fill(equal, equal + maskWords(count), 0);
+    markEqualBytesFrom(a, b, 0, count, equal);
+}
+
+bool equalBytesScalar(const uint8_t* a, const uint8_t* b, size_t count) {
+    return std::equal(a, a + count, b);
+}
+
+void fillBytesScalar(uint8_t* bytes, size_t count, uint8_t value) {
+    std::fill(bytes, bytes + count, value);
+}
+
+const Kernels scalarKernels{
+    expandIndicesScalar,
+    expandPackedScalar,
+    unpackNibblesScalar,
+    quantizePixelsScalar,
+    markRunStartsScalar,
+    markEqualBytesScalar,
+    equalBytesScalar,
+    fillBytesScalar,
+};
+
+#ifdef SCIVEC_X86_DISPATCH
+
+
+// The palette split into byte planes, for lookups with byte shuffles
+struct PalettePlanes {
+    explicit PalettePlanes(const Pixel* palette) {
+        for (int i = 0; i < 16; i++) {
+            bytes[0][i] = palette[i].r;
+            bytes[1][i] = palette[i].g;
+            bytes[2][i] = palette[i].b;
+            bytes[3][i] = palette[i].a;
+        }
+    }
+
+    alignas(16) uint8_t bytes[4][16];
+};
+
+__attribute__((target("sse4.1"))) inline void expand16(__m128i indices, const __m128i* planes, Pixel* pixels) {
+    const auto r = _mm_shuffle_epi8(planes[0], indices);
+    const auto g = _mm_shuffle_epi8(planes[1], indices);
+    const auto b = _mm_shuffle_epi8(planes[2], indices);
+    const auto a = _mm_shuffle_epi8(planes[3], indices);
+
+    const auto rgLow = _mm_unpacklo_epi8(r, g);
+    const auto rgHigh = _mm_unpackhi_epi8(r, g);
+    const auto baLow = _mm_unpacklo_epi8(b, a);
+    const auto baHigh = _mm_unpackhi_epi8(b, a);
+
+    auto* out = reinterpret_cast<__m128i*>(pixels);
+    _mm_storeu_si128(out, _mm_unpacklo_epi16(rgLow, baLow));
+    _mm_storeu_si128(out + 1, _mm_unpackhi_epi16(rgLow, baLow));
+    _mm_storeu_si128(out + 2, _mm_unpacklo_epi16(rgHigh, baHigh));
+    _mm_storeu_si128(out + 3, _mm_unpackhi_epi16(rgHigh, baHigh));
+}
+
+__attribute__((target("sse4.1"))) void loadPlanes(const Pixel* palette, __m128i* planes) {
+    const PalettePlanes bytes(palette);
+    for (int i = 0; i < 4; i++) {
+        planes[i] = _mm_load_si128(reinterpret_cast<const __m128i*>(bytes.bytes[i]));
+    }
+}
+
+__attribute__((target("sse4.1"))) void expandIndicesSSE41(const uint8_t* indices,
+    size_t count,
+    const Pixel* palette,
+    Pixel* pixels) {
+    __m128i planes[4];
+    loadPlanes(palette, planes);
+    const auto lowNibbles = _mm_set1_epi8(0x0f);
+
+    size_t i = 0;
+    for (; i + 16 <= count; i += 16) {
+        const auto block = _mm_loadu_si128(reinterpret_cast<const __m128i*>(indices + i));
+        expand16(_mm_and_si128(block, lowNibbles), planes, pixels + i);
+    }
+    expandIndicesScalar(indices + i, count - i, palette, pixels + i);
+}
+
+__attribute__((target("sse4.1"))) void expandPackedSSE41(const uint8_t* packed,
+    size_t count,
+    const Pixel* palette,
+    Pixel* pixels) {
+    __m128i planes[4];
+    loadPlanes(palette, planes);
+    const auto lowNibbles = _mm_set1_epi8(0x0f);
+
+    size_t i = 0;
+    for (; i + 32 <= count; i += 32) {
+        const auto pairs = _mm_loadu_si128(reinterpret_cast<const __m128i*>(packed + i / 2));
+        const auto even = _mm_and_si128(pairs, lowNibbles);
+        const auto odd = _mm_and_si128(_mm_srli_epi16(pairs, 4), lowNibbles);
+        expand16(_mm_unpacklo_epi8(even, odd), planes, pixels + i);
+        expand16(_mm_unpackhi_epi8(even, odd), planes, pixels + i + 16);
+    }
+    expandPackedScalar(packed + i / 2, count - i, palette, pixels + i);
+}
+
+__attribute__((target("avx2"))) inline void expand32(__m256i indices, const __m256i* planes, Pixel* pixels) {
+    // Shuffles and unpacks work within 128 bit lanes, the final permutes restore pixel order
+    const auto r = _mm256_shuffle_epi8(planes[0], indices);
+    const auto g = _mm256_shuffle_epi8(planes[1], indices);
+    const auto b = _mm256_shuffle_epi8(planes[2], indices);
+    const auto a = _mm256_shuffle_epi8(planes[3], indices);
+
+    const auto rgLow = _mm256_unpacklo_epi8(r, g);
+    const auto rgHigh = _mm256_unpackhi_epi8(r, g);
+    const auto baLow = _mm256_unpacklo_epi8(b, a);
+    const auto baHigh = _mm256_unpackhi_epi8(b, a);
+
+    const auto p0 = _mm256_unpacklo_epi16(rgLow, baLow);
+    const auto p1 = _mm256_unpackhi_epi16(rgLow, baLow);
+    const auto p2 = _mm256_unpacklo_epi16(rgHigh, baHigh);
+    const auto p3 = _mm256_unpackhi_epi16(rgHigh, baHigh);
+
+    auto* out = reinterpret_cast<__m256i*>(pixels);
+    _mm256_storeu_si256(out, _mm256_permute2x128_si256(p0, p1, 0x20));
+    _mm256_storeu_si256(out + 1, _mm256_permute2x128_si256(p2, p3, 0x20));
+    _mm256_storeu_si256(out + 2, _mm256_permute2x128_si256(p0, p1, 0x31));
+    _mm256_storeu_si256(out + 3, _mm256_permute2x128_si256(p2, p3, 0x31));
+}
+
+__attribute__((target("avx2"))) void loadPlanes(const Pixel* palette, __m256i* planes) {
+    const PalettePlanes bytes(palette);
+    for (int i = 0; i < 4; i++) {
+        planes[i] = _mm256_broadcastsi128_si256(_mm_load_si128(reinterpret_cast<const __m128i*>(bytes.bytes[i])));
+    }
+}
+
+__attribute__((target("avx2"))) void expandIndicesAVX2(const uint8_t* indices,
+    size_t count,
+    const Pixel* palette,
+    Pixel* pixels) {
+    __m256i planes[4];
+    loadPlanes(palette, planes);
+    const auto lowNibbles = _mm256_set1_epi8(0x0f);
+
+    size_t i = 0;
+    for (; i + 32 <= count; i += 32) {
+        const auto block = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(indices + i));
+        expand32(_mm256_and_si256(block, lowNibbles), planes, pixels + i);
+    }
+    expandIndicesScalar(indices + i, count - i, palette, pixels + i);
+}
+
+__attribute__((target("avx2"))) void expandPackedAVX2(const uint8_t* packed,
+    size_t count,
+    const Pixel* palette,
+    Pixel* pixels) {
+    __m256i planes[4];
+    loadPlanes(palette, planes);
+    const auto lowNibbles = _mm_set1_epi8(0x0f);
+
+    size_t i = 0;
+    for (; i + 32 <= count; i += 32) {
+        const auto pairs = _mm_loadu_si128(reinterpret_cast<const __m128i*>(packed + i / 2));
+        const auto even = _mm_and_si128(pairs, lowNibbles);
+        const auto odd = _mm_and_si128(_mm_srli_epi16(pairs, 4), lowNibbles);
+        const auto indices = _mm256_set_m128i(_mm_unpackhi_epi8(even, odd), _mm_unpacklo_epi8(even, odd));
+        expand32(indices, planes, pixels + i);
+    }
+    expandPackedScalar(packed + i / 2, count - i, palette, pixels + i);
+}
+
+__attribute__((target("sse4.1"))) void unpackNibblesSSE41(const uint8_t* packed, size_t count, uint8_t* indices) {
+    const auto lowNibbles = _mm_set1_epi8(0x0f);
+
+    size_t i = 0;
+    for (; i + 32 <= count; i += 32) {
+        const auto pairs = _mm_loadu_si128(reinterpret_cast<const __m128i*>(packed + i / 2));
+        const auto even = _mm_and_si128(pairs, lowNibbles);
+        const auto odd = _mm_and_si128(_mm_srli_epi16(pairs, 4), lowNibbles);
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(indices + i), _mm_unpacklo_epi8(even, odd));
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(indices + i + 16), _mm_unpackhi_epi8(even, odd));
+    }
+    unpackNibblesScalar(packed + i / 2, count - i, indices + i);
+}
+
+__attribute__((target("avx2"))) void unpackNibblesAVX2(const uint8_t* packed, size_t count, uint8_t* indices) {
+    const auto lowNibbles = _mm256_set1_epi8(0x0f);
+
+    size_t i = 0;
+    for (; i + 64 <= count; i += 64) {
+        const auto pairs = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(packed + i / 2));
+        const auto even = _mm256_and_si256(pairs, lowNibbles);
+        const auto odd = _mm256_and_si256(_mm256_srli_epi16(pairs, 4), lowNibbles);
+        const auto low = _mm256_unpacklo_epi8(even, odd);
+        const auto high = _mm256_unpackhi_epi8(even, odd);
+        auto* out = reinterpret_cast<__m256i*>(indices + i);
+        _mm256_storeu_si256(out, _mm256_permute2x128_si256(low, high, 0x20));
+        _mm256_storeu_si256(out + 1, _mm256_permute2x128_si256(low, high, 0x31));
+    }
+    unpackNibblesScalar(packed + i / 2, count - i, indices + i);
+}
+
+// Pixel distances are summed per 32 bit lane from absolute byte differences, with alpha masked off
+
+__attribute__((target("sse4.1"))) void quantizePixelsSSE41(const Pixel* pixels,
+    size_t count,
+    const Pixel* palette,
+    uint8_t* indices) {
+    const auto rgb = _mm_set1_epi32(0x00ffffff);
+    const auto ones8 = _mm_set1_epi8(1);
+    const auto ones16 = _mm_set1_epi16(1);
+
+    __m128i candidates[16];
+    for (int c = 0; c < 16; c++) {
+        uint32_t word;
+        std::memcpy(&word, &palette[c], sizeof(word));
+        candidates[c] = _mm_and_si128(_mm_set1_epi32(int(word)), rgb);
+    }
+
+    size_t i = 0;
+    for (; i + 4 <= count; i += 4) {
+        const auto block = _mm_and_si128(_mm_loadu_si128(reinterpret_cast<const __m128i*>(pixels + i)), rgb);
+        auto best = _mm_set1_epi32(INT_MAX);
+        auto bestIndex = _mm_setzero_si128();
+
+        for (int c = 0; c < 16; c++) {
+            const auto difference =
+                _mm_sub_epi8(_mm_max_epu8(block, candidates[c]), _mm_min_epu8(block, candidates[c]));
+            const auto distance = _mm_madd_epi16(_mm_maddubs_epi16(difference, ones8), ones16);
+            const auto closer = _mm_cmplt_epi32(distance, best);
+            best = _mm_blendv_epi8(best, distance, closer);
+            bestIndex = _mm_blendv_epi8(bestIndex, _mm_set1_epi32(c), closer);
+        }
+
+        const auto packed = _mm_packus_epi16(_mm_packus_epi32(bestIndex, bestIndex), bestIndex);
+        const auto four = uint32_t(_mm_cvtsi128_si32(packed));
+        std::memcpy(indices + i, &four, sizeof(four));
+    }
+    quantizePixelsScalar(pixels + i, count - i, palette, indices + i);
+}
+
+__attribute__((target("avx2"))) void quantizePixelsAVX2(const Pixel* pixels,
+    size_t count,
+    const Pixel* palette,
+    uint8_t* indices) {
+    const auto rgb = _mm256_set1_epi32(0x00ffffff);
+    const auto ones8 = _mm256_set1_epi8(1);
+    const auto ones16 = _mm256_set1_epi16(1);
+
+    __m256i candidates[16];
+    for (int c = 0; c < 16; c++) {
+        uint32_t word;
+        std::memcpy(&word, &palette[c], sizeof(word));
+        candidates[c] = _mm256_and_si256(_mm256_set1_epi32(int(word)), rgb);
+    }
+
+    size_t i = 0;
+    for (; i + 8 <= count; i += 8) {
+        const auto block = _mm256_and_si256(_mm256_loadu_si256(reinterpret_cast<const __m256i*>(pixels + i)), rgb);
+        auto best = _mm256_set1_epi32(INT_MAX);
+        auto bestIndex = _mm256_setzero_si256();
+
+        for (int c = 0; c < 16; c++) {
+            const auto difference =
+                _mm256_sub_epi8(_mm256_max_epu8(block, candidates[c]), _mm256_min_epu8(block, candidates[c]));
+            const auto distance = _mm256_madd_epi16(_mm256_maddubs_epi16(difference, ones8), ones16);
+            const auto closer = _mm256_cmpgt_epi32(best, distance);
+            best = _mm256_blendv_epi8(best, distance, closer);
+            bestIndex = _mm256_blendv_epi8(bestIndex, _mm256_set1_epi32(c), closer);
+        }
+
+        // Packing works within 128 bit lanes, leaving four indices at the start of each
+        const auto packed = _mm256_packus_epi16(_mm256_packus_epi32(bestIndex, bestIndex), bestIndex);
+        const auto low = uint32_t(_mm_cvtsi128_si32(_mm256_castsi256_si128(packed)));
+        const auto high = uint32_t(_mm_cvtsi128_si32(_mm256_extracti128_si256(packed, 1)));
+        std::memcpy(indices + i, &low, sizeof(low));
+        std::memcpy(indices + i + 4, &high, sizeof(high));
+    }
+    quantizePixelsScalar(pixels + i, count - i, palette, indices + i);
+}
+
+// Run starts compare each block against itself shifted by one pixel, so the first pixel is marked up front
+
+__attribute__((target("sse4.1"))) void markRunStartsSSE41(const uint8_t* row, size_t count, uint64_t* starts) {
+    std::fill(starts, starts + maskWords(count), 0);
+    markRunStartsFrom(row, 0, std::min<size_t>(count, 1), starts);
+
+    size_t i = 1;
+    for (; i + 16 <= count; i += 16) {
+        const auto current = _mm_loadu_si128(reinterpret_cast<const __m128i*>(row + i));
+        const auto previous = _mm_loadu_si128(reinterpret_cast<const __m128i*>(row + i - 1));
+        const auto same = uint32_t(_mm_movemask_epi8(_mm_cmpeq_epi8(current, previous)));
+        markBits(starts, i, ~same & 0xffff);
+    }
+    markRunStartsFrom(row, i, count, starts);
+}
+
+__attribute__((target("avx2"))) void markRunStartsAVX2(const uint8_t* row, size_t count, uint64_t* starts) {
+    std::fill(starts, starts + maskWords(count), 0);
+    markRunStartsFrom(row, 0, std::min<size_t>(count, 1), starts);
+
+    size_t i = 1;
+    for (; i + 32 <= count; i += 32) {
+        const auto current = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(row + i));
+        const auto previous = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(row + i - 1));
+        const auto same = uint32_t(_mm256_movemask_epi8(_mm256_cmpeq_epi8(current, previous)));
+        markBits(starts, i, ~same);
+    }
+    markRunStartsFrom(row, i, count, starts);
+}
+
+__attribute__((target("sse4.1"))) void markEqualBytesSSE41(const uint8_t* a,
+    const uint8_t* b,
+    size_t count,
+    uint64_t* equal) {
+    std::fill(equal, equal + maskWords(count), 0);
+
+    size_t i = 0;
+    for (; i + 16 <= count; i += 16) {
+        const auto va = _mm_loadu_si128(reinterpret_cast<const __m128i*>(a + i));
+        const auto vb = _mm_loadu_si128(reinterpret_cast<const __m128i*>(b + i));
+        markBits(equal, i, uint32_t(_mm_movemask_epi8(_mm_cmpeq_epi8(va, vb))));
+    }
+    markEqualBytesFrom(a, b, i, count, equal);
+}
+
+__attribute__((target("avx2"))) void markEqualBytesAVX2(const uint8_t* a,
+    const uint8_t* b,
+    size_t count,
+    uint64_t* equal) {
+    std::fill(equal, equal + maskWords(count), 0);
+
+    size_t i = 0;
+    for (; i + 32 <= count; i += 32) {
+        const auto va = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(a + i));
+        const auto vb = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(b + i));
+        markBits(equal, i, uint32_t(_mm256_movemask_epi8(_mm256_cmpeq_epi8(va, vb))));
+    }
+    markEqualBytesFrom(a, b, i, count, equal);
+}
+
+__attribute__((target("sse4.1"))) bool equalBytesSSE41(const uint8_t* a, const uint8_t* b, size_t count) {
+    size_t i = 0;
+    for (; i + 16 <= count; i += 16) {
+        const auto va = _mm_loadu_si128(reinterpret_cast<const __m128i*>(a + i));
+        const auto vb = _mm_loadu_si128(reinterpret_cast<const __m128i*>(b + i));
+        if (_mm_movemask_epi8(_mm_cmpeq_epi8(va, vb)) != 0xffff) {
+            return false;
+        }
+    }
+    return equalBytesScalar(a + i, b + i, count - i);
+}
+
+__attribute__((target("avx2"))) bool equalBytesAVX2(const uint8_t* a, const uint8_t* b, size_t count) {
+    size_t i = 0;
+    for (; i + 32 <= count; i += 32) {
+        const auto va = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(a + i));
+        const auto vb = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(b + i));
+        if (uint32_t(_mm256_movemask_epi8(_mm256_cmpeq_epi8(va, vb))) != 0xffffffff) {
+            return false;
+        }
+    }
+    return equalBytesScalar(a + i, b + i, count - i);
+}
+
+__attribute__((target("sse4.1"))) void fillBytesSSE41(uint8_t* bytes, size_t count, uint8_t value) {
+    const auto block = _mm_set1_epi8(char(value));
+    size_t i = 0;
+    for (; i + 16 <= count; i += 16) {
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(bytes + i), block);
+    }
+    fillBytesScalar(bytes + i, count - i, value);
+}
+
+__attribute__((target("avx2"))) void fillBytesAVX2(uint8_t* bytes, size_t count, uint8_t value) {
+    const auto block = _mm256_set1_epi8(char(value));
+    size_t i = 0;
+    for (; i + 32 <= count; i += 32) {
+        _mm256_storeu_si256(reinterpret_cast<__m256i*>(bytes + i), block);
+    }
+    fillBytesScalar(bytes + i, count - i, value);
+}
+
+const Kernels sse41Kernels{
+    expandIndicesSSE41,
+    expandPackedSSE41,
+    unpackNibblesSSE41,
+    quantizePixelsSSE41,
+    markRunStartsSSE41,
+    markEqualBytesSSE41,
+    equalBytesSSE41,
+    fillBytesSSE41,
+};
+
+const Kernels avx2Kernels{
+    expandIndicesAVX2,
+    expandPackedAVX2,
+    unpackNibblesAVX2,
+    quantizePixelsAVX2,
+    markRunStartsAVX2,
+    markEqualBytesAVX2,
+    equalBytesAVX2,
+    fillBytesAVX2,
+};
+
+#endif
+
+constexpr std::array<KernelSet, 3> kernelSets{ KernelSet::scalar, KernelSet::sse41, KernelSet::avx2 };
+
+const Kernels* kernelTable(KernelSet set) {
+    switch (set) {
+        case KernelSet::scalar:
+            return &scalarKernels;
+#ifdef SCIVEC_X86_DISPATCH
+        case KernelSet::sse41:
+            return &sse41Kernels;
+        case KernelSet::avx2:
+            return &avx2Kernels;
+#endif
+        default:
+            return nullptr;
+    }
+}
+
+KernelSet bestKernels() {
+    for (auto set = kernelSets.rbegin(); set != kernelSets.rend(); set++) {
+        if (kernelSetSupported(*set)) {
+            return *set;
+        }
+    }
+    return KernelSet::scalar;
+}
+
+std::atomic<int> selectedSet{ -1 };
+
+const Kernels& kernels() {
+    return *kernelTable(activeKernels());
+}
+
+}  // namespace
+
+std::string_view kernelSetName(KernelSet set) {
+    switch (set) {
+        case KernelSet::scalar:
+            return "scalar";
+        case KernelSet::sse41:
+            return "sse4.1";
+        case KernelSet::avx2:
+            return "avx2";
+    }
+    return "unknown";
+}
+
+std::optional<KernelSet> kernelSetNamed(std::string_view name) {
+    for (const auto set : kernelSets) {
+        if (kernelSetName(set) == name) {
+            return set;
+        }
+    }
+    return std::nullopt;
+}
+
+bool kernelSetSupported(KernelSet set) {
+    if (kernelTable(set) == nullptr) {
+        return false;
+    }
+#ifdef SCIVEC_X86_DISPATCH
+    __builtin_cpu_init();
+    switch (set) {
+        case KernelSet::sse41:
+            return __builtin_cpu_supports("sse4.1");
+        case KernelSet::avx2:
+            return __builtin_cpu_supports("avx2");
+        default:
+            break;
+    }
+#endif
+    return true;
+}
+
+void selectKernels(KernelSet set) {
+    if (!kernelSetSupported(set)) {
+        throw std::runtime_error("Kernel set not supported");
+    }
+    selectedSet = int(set);
+}
+
+KernelSet activeKernels() {
+    auto set = selectedSet.load();
+    if (set == -1) {
+        // Racing first uses agree on the set
+        set = int(bestKernels());
+        selectedSet = set;
+    }
+    return KernelSet(set);
+}
+
+bool checkKernels() {
+    std::mt19937 random(0x5c1);
+    const auto byte = [&random]() {
+        return uint8_t(random());
+    };
+
+    bool allOK = true;
+
+    for (const auto set : kernelSets) {
+        if (set == KernelSet::scalar || !kernelSetSupported(set)) {
+            continue;
+        }
+        const auto& reference = scalarKernels;
+        const auto& variant = *kernelTable(set);
+        std::vector<std::string_view> failures;
+
+        const auto check = [&failures](bool ok, std::string_view kernel) {
+            if (!ok && std::ranges::find(failures, kernel) == failures.end()) {
+                failures.push_back(kernel);
+            }
+        };
+
+        for (int frame = 0; frame < 32; frame++) {
+            // Odd sizes exercise the scalar tails
+            const size_t count = 320 * 190 - random() % 64;
+
+            std::array<Pixel, 16> palette;
+            for (auto& color : palette) {
+                color = Pixel{ byte(), byte(), byte(), byte() };
+            }
+            // Equally distant colors, to check ties
+            palette[random() % 16] = palette[random() % 16];
+
+            std::vector<Pixel> pixels(count);
+            for (auto& pixel : pixels) {
+                pixel = random() % 2 == 0 ? palette[random() % 16] : Pixel{ byte(), byte(), byte(), byte() };
+                pixel.r += random() % 3 - 1;
+            }
+
+            std::vector<uint8_t> indices(count);
+            for (auto& index : indices) {
+                index = byte() & 0x0f;
+            }
+
+            std::vector<uint8_t> packed((count + 1) / 2);
+            for (auto& pair : packed) {
+                pair = byte();
+            }
+
+            std::vector<Pixel> expected(count);
+            std::vector<Pixel> actual(count);
+            const auto samePixels = [&]() {
+                return std::memcmp(expected.data(), actual.data(), count * sizeof(Pixel)) == 0;
+            };
+
+            reference.expandIndices(indices.data(), count, palette.data(), expected.data());
+            variant.expandIndices(indices.data(), count, palette.data(), actual.data());
+            check(samePixels(), "expandIndices");
+
+            reference.expandPacked(packed.data(), count, palette.data(), expected.data());
+            variant.expandPacked(packed.data(), count, palette.data(), actual.data());
+            check(samePixels(), "expandPacked");
+
+            std::vector<uint8_t> expectedBytes(count);
+            std::vector<uint8_t> actualBytes(count);
+
+            reference.unpackNibbles(packed.data(), count, expectedBytes.data());
+            variant.unpackNibbles(packed.data(), count, actualBytes.data());
+            check(expectedBytes == actualBytes, "unpackNibbles");
+
+            reference.quantizePixels(pixels.data(), count, palette.data(), expectedBytes.data());
+            variant.quantizePixels(pixels.data(), count, palette.data(), actualBytes.data());
+            check(expectedBytes == actualBytes, "quantizePixels");
+
+            const auto value = byte();
+            reference.fillBytes(expectedBytes.data(), count, value);
+            variant.fillBytes(actualBytes.data(), count, value);
+            check(expectedBytes == actualBytes, "fillBytes");
+
+            // Palette image rows, with runs and partly repeated rows
+            std::vector<uint8_t> rows(count);
+            for (size_t i = 0; i < count;) {
+                const auto length = std::min<size_t>(1 + random() % 40, count - i);
+                std::fill_n(rows.begin() + i, length, byte() % 40);
+                i += length;
+            }
+            for (size_t i = 320; i < count; i++) {
+                if (random() % 4 != 0) {
+                    rows[i] = rows[i - 320];
+                }
+            }
+            std::vector<uint64_t> expectedMask(count / 64 + 2, ~0ull);
+            std::vector<uint64_t> actualMask(count / 64 + 2, ~0ull);
+
+            for (size_t row = 0; row + 1 < count / 320; row++) {
+                const auto* current = rows.data() + row * 320;
+                const size_t width = 320 - row % 64;
+                reference.markRunStarts(current, width, expectedMask.data());
+                variant.markRunStarts(current, width, actualMask.data());
+                check(expectedMask == actualMask, "markRunStarts");
+
+                reference.markEqualBytes(current, current + 320, width, expectedMask.data());
+                variant.markEqualBytes(current, current + 320, width, actualMask.data());
+                check(expectedMask == actualMask, "markEqualBytes");
+            }
+
+            auto changed = indices;
+            changed[random() % count] ^= 1 + byte() % 15;
+            check(variant.equalBytes(indices.data(), indices.data(), count), "equalBytes");
+            check(variant.equalBytes(indices.data(), changed.data(), count) ==
+                      reference.equalBytes(indices.data(), changed.data(), count),
+                "equalBytes");
+        }
+
+        if (failures.empty()) {
+            printf("%s: OK\n", kernelSetName(set).data());
+        } else {
+            allOK = false;
+            for (const auto failure : failures) {
+                printf("%s: %s differs from scalar\n", kernelSetName(set).data(), failure.data());
+            }
+        }
+    }
+
+    return allOK;
+}
+
+void expandIndices(std::span<const uint8_t> indices, std::span<Pixel> pixels, std::span<const Pixel, 16> palette) {
+    assert(indices.size() >= pixels.size());
+    kernels().expandIndices(indices.data(), pixels.size(), palette.data(), pixels.data());
+}
+
+void expandPacked(std::span<const uint8_t> packed, std::span<Pixel> pixels, std::span<const Pixel, 16> palette) {
+    assert(packed.size() * 2 >= pixels.size());
+    kernels().expandPacked(packed.data(), pixels.size(), palette.data(), pixels.data());
+}
+
+void unpackNibbles(std::span<const uint8_t> packed, std::span<uint8_t> indices) {
+    assert(packed.size() * 2 >= indices.size());
+    kernels().unpackNibbles(packed.data(), indices.size(), indices.data());
+}
+
+void quantizePixels(std::span<const Pixel> pixels, std::span<uint8_t> indices, std::span<const Pixel, 16> palette) {
+    assert(indices.size() >= pixels.size());
+    kernels().quantizePixels(pixels.data(), pixels.size(), palette.data(), indices.data());
+}
+
+void markRunStarts(std::span<const uint8_t> row, std::span<uint64_t> starts) {
+    assert(starts.size() >= maskWords(row.size()));
+    kernels().markRunStarts(row.data(), row.size(), starts.data());
+}
+
+void markEqualBytes(std::span<const uint8_t> a, std::span<const uint8_t> b, std::span<uint64_t> equal) {
+    assert(a.size() == b.size());
+    assert(equal.size() >= maskWords(a.size()));
+    kernels().markEqualBytes(a.data(), b.data(), a.size(), equal.data());
+}
+
+bool equalBytes(std::span<const uint8_t> a, std::span<const uint8_t> b) {
+    return a.size() == b.size() && kernels().equalBytes(a.data(), b.data(), a.size());
+}
+
+void fillBytes(std::span<uint8_t> bytes, uint8_t value) {
+    kernels().fillBytes(bytes.data(), bytes.size(), value);
+}
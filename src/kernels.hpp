@@ -0,0 +1,52 @@
+#pragma once
+#include <cstdint>
+#include <optional>
+#include <span>
+#include <string_view>
+
+#include "pixel.hpp"
+
+// Hot pixel loops come in scalar and SIMD variants. The best set the CPU supports
+// is picked on first use, unless one is selected before that.
+enum class KernelSet {
+    scalar,
+    sse41,
+    avx2,
+};
+
+std::string_view kernelSetName(KernelSet set);
+std::optional<KernelSet> kernelSetNamed(std::string_view name);
+bool kernelSetSupported(KernelSet set);
+
+void selectKernels(KernelSet set);
+KernelSet activeKernels();
+
+// Compares every supported variant against the scalar one over random frames,
+// printing the outcome per kernel set
+bool checkKernels();
+
+// Expands 16 color pixels, one per byte, to RGBA through a 16 entry palette
+void expandIndices(std::span<const uint8_t> indices, std::span<Pixel> pixels, std::span<const Pixel, 16> palette);
+
+// Expands 16 color pixels, packed two per byte with the left pixel in the low nibble,
+// to RGBA through a 16 entry palette
+void expandPacked(std::span<const uint8_t> packed, std::span<Pixel> pixels, std::span<const Pixel, 16> palette);
+
+// Unpacks 16 color pixels, packed as above, to one per byte
+void unpackNibbles(std::span<const uint8_t> packed, std::span<uint8_t> indices);
+
+// Maps RGBA pixels to the index of the closest of 16 palette colors, ignoring alpha.
+// Ties go to the lowest index.
+void quantizePixels(std::span<const Pixel> pixels, std::span<uint8_t> indices, std::span<const Pixel, 16> palette);
+
+// Row bitmasks have bit x % 64 of word x / 64 set for pixel x, and unused bits clear.
+
+// Marks the pixels that start a run, that is the first pixel and any pixel differing from its left neighbour
+void markRunStarts(std::span<const uint8_t> row, std::span<uint64_t> starts);
+
+// Marks the pixels equal in both rows
+void markEqualBytes(std::span<const uint8_t> a, std::span<const uint8_t> b, std::span<uint64_t> equal);
+
+bool equalBytes(std::span<const uint8_t> a, std::span<const uint8_t> b);
+
+void fillBytes(std::span<uint8_t> bytes, uint8_t value);
@@ -1,11 +1,28 @@
 #include <string_view>
 #include <fstream>
 #include <vector>
+#include <map>
+#include <set>
+#include <optional>
+#include <charconv>
+#include <filesystem>
+#include <chrono>
+#include <algorithm>
+#include <cctype>
 
 #include "scipicparser.hpp"
 #include "scipicvectorizer.hpp"
+#include "scipicencoder.hpp"
 #include "image.hpp"
 #include "palette.hpp"
+#include "parallel.hpp"
+#include "kernels.hpp"
+#include "scivec.hpp"
+#include "bitmap.hpp"
+#include "server.hpp"
+#include "watcher.hpp"
+#include "hash.hpp"
+#include "cache.hpp"
 
 std::vector<uint8_t> loadFile(std::string_view fileName) {
     std::ifstream ifs(std::string(fileName), std::ios::binary | std::ios::ate);
@@ -35,6 +52,22 @@ void saveFile(std::string_view fileName, std::span<const uint8_t> data) {
     ofs.write(reinterpret_cast<const char*>(data.data()), data.size());
 }
 
+// Writes next to the destination and renames over it, so readers never see a partial file
+void saveFileAtomically(const std::filesystem::path& fileName, std::span<const uint8_t> data) {
+    auto tempName = fileName;
+    tempName += ".tmp";
+    {
+        std::ofstream ofs(tempName, std::ios::binary);
+        ofs.write(reinterpret_cast<const char*>(data.data()), data.size());
+        ofs.close();
+        if (!ofs) {
+            std::filesystem::remove(tempName);
+            throw std::runtime_error("Failed to write output");
+        }
+    }
+    std::filesystem::rename(tempName, fileName);
+}
+
 using NamedPic = std::pair<Tigr*, std::string>;
 
 void show(std::initializer_list<NamedPic> pics, std::function<void(int x, int y, bool tapped, Tigr* screen)> inspect) {
@@ -76,8 +109,41 @@ void help() {
         "    scivec convert <input image file> <output sci file> [options]\n"
         "        -show        Show converted results\n"
         "        -noverify    Skip verification of converted image\n"
+        "        -orderbudget=<moves>\n"
+        "                     Search budget for the area draw order, 0 disables (default 64)\n"
+        "        -tiles=<bands>\n"
+        "                     Label areas in parallel horizontal bands (default 1)\n"
+        "        -nocache     Always convert, without reading or writing the cache\n"
+        "        -cachedir=<dir>\n"
+        "                     Conversion cache location (default ~/.cache/scivec)\n"
+        "        -cachesize=<megabytes>\n"
+        "                     Evict least recently used conversions beyond this size (default 256)\n"
+        "        -cacheage=<days>\n"
+        "                     Evict conversions unused for this long (default 30)\n"
+        "\n"
+        "    scivec convert-batch <output directory> <input image files...> [options]\n"
+        "        Converts all images in parallel to <output directory>/<image name>.pic,\n"
+        "        taking the same options as convert except -show\n"
+        "\n"
+        "    scivec watch <image directory> [output directory] [options]\n"
+        "        Converts images to <output directory>/<image name>.pic whenever they are\n"
+        "        saved, taking the same options as convert-batch. The output directory\n"
+        "        defaults to the image directory.\n"
+        "        -debounce=<ms>\n"
+        "                     Wait for writes to settle this long (default 250)\n"
+        "\n"
+        "    scivec serve [socket path]\n"
+        "        Converts length-prefixed requests from stdin, or from connections to a\n"
+        "        Unix domain socket, until stopped. See the README for the protocol.\n"
+        "\n"
+        "    scivec show <sci file>\n"
         "\n"
-        "    scivec show <sci file>\n");
+        "Common options:\n"
+        "    -threads=<count> Worker threads, 0 uses all cores (default 0)\n"
+        "    -pin             Pin worker threads to cores (Linux only)\n"
+        "    -kernels         Show the active and supported SIMD kernel sets\n"
+        "    -kernels=<set>   Use the scalar, sse4.1 or avx2 kernel set\n"
+        "    -kernels=check   Check all supported kernel sets against the scalar one\n");
 }
 
 void fatal(const char* message) {
@@ -90,19 +156,88 @@ using Params = std::span<const std::string_view>;
 using Flags = std::set<std::string_view>;
 using Command = void(Params params, const Flags& flags);
 
+std::optional<std::string_view> flagValue(const Flags& flags, std::string_view name) {
+    for (const auto& flag : flags) {
+        if (flag.starts_with(name) && flag.size() > name.size() && flag[name.size()] == '=') {
+            return flag.substr(name.size() + 1);
+        }
+    }
+    return std::nullopt;
+}
+
+int intFlag(const Flags& flags, std::string_view name, int defaultValue) {
+    const auto value = flagValue(flags, name);
+    if (!value) {
+        return defaultValue;
+    }
+    int result = 0;
+    const auto [end, error] = std::from_chars(value->data(), value->data() + value->size(), result);
+    if (error != std::errc() || end != value->data() + value->size()) {
+        fatal("invalid flag value");
+    }
+    return result;
+}
+
 void cmdShow(Params params, const Flags& flags) {
     if (params.size() != 1) {
         fatal("expected sci picture file argument");
     }
 
     const auto sciData = loadFile(params.front());
-    SCIPicParser parser(sciData);
+    DynamicSCIPicParser parser(sciData);
     parser.parse();
-    const auto bmp = parser.bitmap();
+    const auto bmp = toBitmap(parser.image());
     show({ { bmp.get(), "SCI" } }, [](int x, int y, bool tapped, Tigr* scr) {
     });
 }
 
+EGAImage loadEGAImage(std::string_view fileName, const StageStore* stages = nullptr) {
+    const ImageFile img(fileName);
+    return mapToEGA(img.view(), stages);
+}
+
+bool rendersAsOriginal(const EGAImage& ei, const SCIPicParser& parser) {
+    return ei == parser.image();
+}
+
+VectorizerOptions vectorizerOptions(const Flags& flags) {
+    VectorizerOptions options;
+    options.orderBudget = intFlag(flags, "-orderbudget", options.orderBudget);
+    options.tiles = intFlag(flags, "-tiles", options.tiles);
+    return options;
+}
+
+ConvertOptions convertOptions(const Flags& flags) {
+    ConvertOptions options;
+    options.vectorizer = vectorizerOptions(flags);
+    options.verify = !flags.contains("-noverify");
+    return options;
+}
+
+// The conversion cache, unless disabled or unavailable
+std::optional<ConversionCache> openCache(const Flags& flags) {
+    if (flags.contains("-nocache")) {
+        return std::nullopt;
+    }
+
+    CacheOptions options;
+    options.dir = flagValue(flags, "-cachedir").value_or(defaultCacheDir().string());
+    const auto size = intFlag(flags, "-cachesize", int(options.maxSize >> 20));
+    const auto age = intFlag(flags, "-cacheage", int(options.maxAge.count() / 24));
+    if (size < 0 || age < 0) {
+        fatal("invalid cache limit");
+    }
+    options.maxSize = uintmax_t(size) << 20;
+    options.maxAge = std::chrono::hours(24 * age);
+
+    try {
+        return ConversionCache(options);
+    } catch (const std::exception& e) {
+        fprintf(stderr, "Not caching conversions: %s\n", e.what());
+        return std::nullopt;
+    }
+}
+
 void cmdConvert(Params params, const Flags& flags) {
     if (params.size() < 1) {
         fatal("expected image file argument");
@@ -117,28 +252,38 @@ void cmdConvert(Params params, const Flags& flags) {
         savePath = params[1];
     }
 
-    const ImageFile img(params.front());
-    auto imageBmp = img.asBitmap();
-
-    Tigr* bmp = tigrBitmap(320, 190);
-    tigrClear(bmp, { 0, 0, 0, 0 });
-    tigrBlit(bmp, imageBmp.get(), 0, 0, 0, 0, std::min(bmp->w, imageBmp->w), std::min(bmp->h, imageBmp->h));
-
-    const EGAImage ei(*bmp);
+    const auto cache = openCache(flags);
+    const StageStore* stages = cache ? &*cache : nullptr;
+    const auto ei = loadEGAImage(params.front(), stages);
+
+    // Shown conversions need the vectorizer, so they are never taken from the cache
+    const auto cacheKey = ConversionCache::key(ei, convertOptions(flags));
+    if (cache && !flags.contains("-show")) {
+        if (const auto cached = cache->load(cacheKey)) {
+            fprintf(stderr, "Using cached conversion\n");
+            printf("Produced %zu commands\n", cached->report.commands);
+            printf("Size: %zu bytes\n", cached->report.size);
+            if (!savePath.empty()) {
+                saveFile(savePath, cached->pic);
+            } else {
+                fprintf(stderr, "No destination file given, no output written\n");
+            }
+            if (cached->report.verification == Verification::passed) {
+                fprintf(stderr, "Conversion verifies OK\n");
+            }
+            cache->trim();
+            return;
+        }
+    }
 
     fprintf(stderr, "Converting...\n");
-    auto vec = SCIPicVectorizer(ei);
+    auto vec = SCIPicVectorizer(ei, vectorizerOptions(flags), nullptr, stages);
     vec.scan();
-    auto commands = vec.encode();
+    const auto commands = vec.encode();
+    printf("Produced %zu commands\n", commands.size());
+    printf("Size: %zu bytes\n", encodedSize(commands));
 
-    std::vector<uint8_t> sciData{ 0x81, 0x00 };
-
-    for (const auto& command : commands) {
-        sciData.push_back(command.code);
-        sciData.insert(sciData.end(), command.params.begin(), command.params.end());
-    }
-
-    sciData.push_back(SCICommandCode::pictureEnd);
+    const auto sciData = picData(commands);
 
     SCIPicParser parser(sciData);
     parser.parse();
@@ -151,20 +296,7 @@ void cmdConvert(Params params, const Flags& flags) {
     }
 
     if (!flags.contains("-noverify")) {
-        auto orig = ei.asBitmap();
-        auto converted = parser.bitmap();
-        bool equal = true;
-
-        for (int y = 0; equal && y < std::min(orig->h, converted->h); y++) {
-            for (int x = 0; equal && x < std::min(orig->w, converted->w); x++) {
-                const auto& o = tigrGet(orig.get(), x, y);
-                const auto& c = tigrGet(converted.get(), x, y);
-                if (o.a != c.a || o.r != c.r || o.g != c.g || o.b != c.b) {
-                    equal = false;
-                }
-            }
-        }
-        if (!equal) {
+        if (!rendersAsOriginal(ei, parser)) {
             fprintf(stderr, "Parsed file not equal to original\n");
             if (!flags.contains("-show")) {
                 exit(1);
@@ -174,12 +306,21 @@ void cmdConvert(Params params, const Flags& flags) {
         }
     }
 
+    if (cache) {
+        Conversion conversion{ sciData };
+        conversion.report.commands = commands.size();
+        conversion.report.size = encodedSize(commands);
+        conversion.report.verification = flags.contains("-noverify") ? Verification::skipped : Verification::passed;
+        cache->store(cacheKey, conversion);
+        cache->trim();
+    }
+
     if (flags.contains("-show")) {
         float counter = 0;
         int limit = 1;
 
-        auto orig = ei.asBitmap();
-        auto converted = parser.bitmap();
+        auto orig = toBitmap(ei);
+        auto converted = toBitmap(parser.image());
 
         show({ { converted.get(), "Converted" }, { orig.get(), "Original" } },
             [&vec, &counter, &palette, &limit, &parser, &converted](int x, int y, bool tapped, Tigr* scr) {
@@ -198,7 +339,7 @@ void cmdConvert(Params params, const Flags& flags) {
                 }
                 if (preLimit != limit) {
                     parser.parse(limit);
-                    const auto newPic = parser.bitmap();
+                    const auto newPic = toBitmap(parser.image());
                     tigrBlit(converted.get(), newPic.get(), 0, 0, 0, 0, newPic->w, newPic->h);
                 }
 
@@ -248,6 +389,234 @@ void cmdConvert(Params params, const Flags& flags) {
     }
 }
 
+void cmdConvertBatch(Params params, const Flags& flags) {
+    if (params.size() < 2) {
+        fatal("expected output directory and image file arguments");
+    }
+
+    const std::filesystem::path outputDir(params.front());
+    if (!std::filesystem::is_directory(outputDir)) {
+        fatal("output directory does not exist");
+    }
+
+    const auto inputs = params.subspan(1);
+    const auto options = convertOptions(flags);
+    const auto cache = openCache(flags);
+
+    struct Result {
+        size_t size{ 0 };
+        bool cached{ false };
+        std::string error;
+    };
+    std::vector<Result> results(inputs.size());
+
+    const StageStore* stages = cache ? &*cache : nullptr;
+    ConverterPool converters(stages);
+
+    // Images are converted as tasks on the shared scheduler, nesting their own parallel stages
+    parallelFor(inputs.size(), [&](size_t i) {
+        auto& result = results[i];
+        try {
+            const auto image = loadEGAImage(inputs[i], stages);
+            const auto key = ConversionCache::key(image, options);
+
+            std::optional<Conversion> cached;
+            if (cache) {
+                cached = cache->load(key);
+            }
+            result.cached = cached.has_value();
+
+            const auto conversion = cached ? std::move(*cached) : converters.borrow()->convert(image, options);
+            if (conversion.report.verification == Verification::failed) {
+                result.error = "parsed file not equal to original";
+                return;
+            }
+
+            auto outputPath = outputDir / std::filesystem::path(inputs[i]).stem();
+            outputPath += ".pic";
+            saveFile(outputPath.string(), conversion.pic);
+            result.size = conversion.pic.size();
+
+            if (cache && !cached) {
+                cache->store(key, conversion);
+            }
+        } catch (const std::exception& e) {
+            result.error = e.what();
+        }
+    });
+
+    if (cache) {
+        cache->trim();
+    }
+
+    int failures = 0;
+    for (size_t i = 0; i < inputs.size(); i++) {
+        const auto& result = results[i];
+        if (result.error.empty()) {
+            printf("%.*s: %zu bytes%s\n",
+                int(inputs[i].size()),
+                inputs[i].data(),
+                result.size,
+                result.cached ? " (cached)" : "");
+        } else {
+            fprintf(stderr, "%.*s: %s\n", int(inputs[i].size()), inputs[i].data(), result.error.c_str());
+            failures++;
+        }
+    }
+
+    if (failures > 0) {
+        fprintf(stderr, "%d of %zu conversions failed\n", failures, inputs.size());
+        exit(1);
+    }
+}
+
+bool isImageFile(const std::filesystem::path& path) {
+    auto extension = path.extension().string();
+    std::transform(extension.begin(), extension.end(), extension.begin(), [](unsigned char c) {
+        return char(std::tolower(c));
+    });
+    static const std::set<std::string> extensions{ ".png", ".bmp", ".gif", ".jpg", ".jpeg", ".tga", ".psd", ".ppm", ".pgm" };
+    return extensions.contains(extension);
+}
+
+void cmdWatch(Params params, const Flags& flags) {
+    if (params.size() < 1) {
+        fatal("expected image directory argument");
+    }
+    if (params.size() > 2) {
+        fatal("unexpected arguments");
+    }
+
+    const std::filesystem::path inputDir(params.front());
+    const std::filesystem::path outputDir(params.size() == 2 ? params[1] : params.front());
+    if (!std::filesystem::is_directory(inputDir) || !std::filesystem::is_directory(outputDir)) {
+        fatal("directory does not exist");
+    }
+
+    const auto options = convertOptions(flags);
+    const auto debounce = intFlag(flags, "-debounce", 250);
+    if (debounce < 0) {
+        fatal("invalid debounce time");
+    }
+
+    // Kept for the whole session, along with the kernel and palette tables
+    const auto cache = openCache(flags);
+    const StageStore* stages = cache ? &*cache : nullptr;
+    Converter converter(stages);
+    std::map<std::filesystem::path, uint64_t> convertedHashes;
+    // Edits are reconverted from the scan of the previous version of the image
+    std::map<std::filesystem::path, ScanState> states;
+
+    const auto outputPath = [&outputDir](const std::filesystem::path& input) {
+        auto path = outputDir / input.stem();
+        path += ".pic";
+        return path;
+    };
+
+    const auto convertFile = [&](const std::filesystem::path& input) {
+        if (!isImageFile(input)) {
+            return;
+        }
+        const auto name = input.filename().string();
+
+        std::vector<uint8_t> data;
+        try {
+            data = loadFile(input.string());
+        } catch (const std::exception&) {
+            // Gone again before we got to it
+            return;
+        }
+
+        // Saving without changes, or touching the file, is not worth a conversion
+        const auto hash = Hash().add(data).value();
+        const auto previous = convertedHashes.find(input);
+        if (previous != convertedHashes.end() && previous->second == hash) {
+            return;
+        }
+        convertedHashes[input] = hash;
+
+        const auto start = std::chrono::steady_clock::now();
+        try {
+            const auto image = mapToEGA(ImageFile(data).view(), stages);
+            const auto key = ConversionCache::key(image, options);
+
+            std::optional<Conversion> cached;
+            if (cache) {
+                cached = cache->load(key);
+            }
+            const auto conversion = cached ? std::move(*cached) : converter.convert(image, options, states[input]);
+            if (conversion.report.verification == Verification::failed) {
+                fprintf(stderr, "%s: parsed file not equal to original\n", name.c_str());
+                return;
+            }
+            saveFileAtomically(outputPath(input), conversion.pic);
+            // Incremental results depend on the versions seen before, so only full ones are shared
+            if (cache && !cached && !conversion.report.incremental) {
+                cache->store(key, conversion);
+            }
+
+            const auto elapsed = std::chrono::steady_clock::now() - start;
+            printf("%s: %zu bytes in %lld ms%s\n",
+                name.c_str(),
+                conversion.pic.size(),
+                (long long)std::chrono::duration_cast<std::chrono::milliseconds>(elapsed).count(),
+                cached ? " (cached)" : conversion.report.incremental ? " (incremental)" : "");
+        } catch (const std::exception& e) {
+            fprintf(stderr, "%s: %s\n", name.c_str(), e.what());
+        }
+        fflush(stdout);
+    };
+
+    // Catch up on images changed while nobody was watching
+    for (const auto& entry : std::filesystem::directory_iterator(inputDir)) {
+        const auto& input = entry.path();
+        if (!entry.is_regular_file() || !isImageFile(input)) {
+            continue;
+        }
+        const auto output = outputPath(input);
+        std::error_code error;
+        if (!std::filesystem::exists(output) ||
+            std::filesystem::last_write_time(output, error) < entry.last_write_time()) {
+            convertFile(input);
+        } else {
+            try {
+                convertedHashes[input] = Hash().add(loadFile(input.string())).value();
+            } catch (const std::exception&) {
+            }
+        }
+    }
+
+    if (cache) {
+        cache->trim();
+    }
+
+    fprintf(stderr, "Watching %s\n", inputDir.string().c_str());
+    fflush(stdout);
+    try {
+        watchDirectory(inputDir, std::chrono::milliseconds(debounce), convertFile);
+    } catch (const std::exception& e) {
+        fprintf(stderr, "%s\n", e.what());
+        exit(1);
+    }
+}
+
+void cmdServe(Params params, const Flags& flags) {
+    if (params.size() > 1) {
+        fatal("unexpected arguments");
+    }
+
+    try {
+        if (params.empty()) {
+            serveStdio();
+        } else {
+            serveSocket(params.front());
+        }
+    } catch (const std::exception& e) {
+        fprintf(stderr, "%s\n", e.what());
+        exit(1);
+    }
+}
+
 int main(int argc, const char** argv) {
     const auto args = std::span<const char*>(argv, argv + argc);
     std::vector<std::string_view> params;
@@ -267,11 +636,46 @@ int main(int argc, const char** argv) {
         exit(0);
     }
 
+    if (const auto kernels = flagValue(flags, "-kernels")) {
+        if (*kernels == "check") {
+            exit(checkKernels() ? 0 : 1);
+        }
+        const auto set = kernelSetNamed(*kernels);
+        if (!set) {
+            fatal("unknown kernel set");
+        }
+        if (!kernelSetSupported(*set)) {
+            fatal("kernel set not supported by this CPU");
+        }
+        selectKernels(*set);
+    }
+
+    if (flags.contains("-kernels")) {
+        printf("Active kernels: %s\nSupported:", kernelSetName(activeKernels()).data());
+        for (const auto set : { KernelSet::scalar, KernelSet::sse41, KernelSet::avx2 }) {
+            if (kernelSetSupported(set)) {
+                printf(" %s", kernelSetName(set).data());
+            }
+        }
+        printf("\n");
+        if (params.empty()) {
+            exit(0);
+        }
+    }
+
     if (params.empty()) {
         fatal("expected command");
     }
 
-    std::map<std::string_view, Command*> commands{ { "show", cmdShow }, { "convert", cmdConvert } };
+    const auto threads = intFlag(flags, "-threads", 0);
+    if (threads < 0) {
+        fatal("invalid thread count");
+    }
+    configureScheduler(threads, flags.contains("-pin"));
+
+    std::map<std::string_view, Command*> commands{
+        { "show", cmdShow }, { "convert", cmdConvert }, { "convert-batch", cmdConvertBatch }, { "watch", cmdWatch },
+        { "serve", cmdServe } };
 
     const auto& command = params.front();
     if (!commands.contains(command)) {
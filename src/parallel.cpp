@@ -0,0 +1,238 @@
+#include "parallel.hpp"
+#include <algorithm>
+#include <exception>
+#include <stdexcept>
+
+#ifdef __linux__
+#include <pthread.h>
+#include <sched.h>
+#endif
+
+namespace {
+
+thread_local size_t currentQueue = 0;
+
+void pinToCore(std::thread& thread, size_t core) {
+#ifdef __linux__
+    cpu_set_t cpus;
+    CPU_ZERO(&cpus);
+    CPU_SET(core % std::max(1u, std::thread::hardware_concurrency()), &cpus);
+    pthread_setaffinity_np(thread.native_handle(), sizeof(cpus), &cpus);
+#else
+    (void)thread;
+    (void)core;
+#endif
+}
+
+std::unique_ptr<TaskScheduler> sharedScheduler;
+std::once_flag sharedSchedulerCreated;
+
+}  // namespace
+
+struct TaskScheduler::Group {
+    std::atomic<size_t> pending;
+    std::mutex errorLock;
+    std::exception_ptr error;
+    // Set for spawned jobs, whose group is freed by whoever finishes it
+    std::function<void(size_t)> job;
+};
+
+TaskScheduler::TaskScheduler(size_t workers, bool pinThreads)
+    : _workerCount(workers > 0 ? workers : std::max(1u, std::thread::hardware_concurrency())) {
+    for (size_t i = 0; i < _workerCount; i++) {
+        _queues.push_back(std::make_unique<Queue>());
+    }
+    for (size_t i = 1; i < _workerCount; i++) {
+        _threads.emplace_back(&TaskScheduler::workerLoop, this, i);
+        if (pinThreads) {
+            pinToCore(_threads.back(), i);
+        }
+    }
+}
+
+TaskScheduler::~TaskScheduler() {
+    {
+        std::lock_guard lock(_sleepLock);
+        _stopping = true;
+    }
+    _wake.notify_all();
+    for (auto& thread : _threads) {
+        thread.join();
+    }
+}
+
+void TaskScheduler::workerLoop(size_t index) {
+    currentQueue = index;
+
+    while (!_stopping) {
+        if (runOne()) {
+            continue;
+        }
+        std::unique_lock lock(_sleepLock);
+        _sleeping++;
+        _wake.wait(lock, [this]() {
+            return _queued > 0 || _stopping;
+        });
+        _sleeping--;
+    }
+}
+
+void TaskScheduler::push(const Task& task) {
+    {
+        auto& queue = *_queues[currentQueue];
+        std::lock_guard lock(queue.lock);
+        queue.tasks.push_back(task);
+        _queued++;
+    }
+    // Sleepers count themselves before checking for work, so none can be missed here
+    if (_sleeping > 0) {
+        {
+            std::lock_guard lock(_sleepLock);
+        }
+        _wake.notify_one();
+    }
+}
+
+bool TaskScheduler::runOne() {
+    std::optional<Task> task;
+
+    // Newest own work first, then the oldest work of others
+    for (size_t i = 0; !task && i < _queues.size(); i++) {
+        const auto index = (currentQueue + i) % _queues.size();
+        auto& queue = *_queues[index];
+        std::lock_guard lock(queue.lock);
+        if (queue.tasks.empty()) {
+            continue;
+        }
+        if (i == 0) {
+            task = queue.tasks.back();
+            queue.tasks.pop_back();
+        } else {
+            task = queue.tasks.front();
+            queue.tasks.pop_front();
+        }
+        _queued--;
+    }
+
+    if (!task) {
+        return false;
+    }
+
+    execute(*task);
+    return true;
+}
+
+void TaskScheduler::execute(Task task) {
+    // Split ranges lazily, leaving the upper halves for thieves
+    while (task.end - task.begin > 1) {
+        const auto middle = task.begin + (task.end - task.begin) / 2;
+        push(Task{ task.body, middle, task.end, task.group });
+        task.end = middle;
+    }
+
+    try {
+        (*task.body)(task.begin);
+    } catch (...) {
+        std::lock_guard lock(task.group->errorLock);
+        if (!task.group->error) {
+            task.group->error = std::current_exception();
+        }
+    }
+
+    // Nobody waits for a spawned job, and a waited for group may be gone once done
+    if (task.group->job) {
+        if (--task.group->pending == 0) {
+            delete task.group;
+        }
+        return;
+    }
+
+    // Waiters sleep until there is work or their group is done
+    if (--task.group->pending == 0 && _sleeping > 0) {
+        {
+            std::lock_guard lock(_sleepLock);
+        }
+        _wake.notify_all();
+    }
+}
+
+void TaskScheduler::parallelFor(size_t count, const std::function<void(size_t)>& body) {
+    if (count == 0) {
+        return;
+    }
+
+    if (_workerCount <= 1 || count == 1) {
+        for (size_t i = 0; i < count; i++) {
+            body(i);
+        }
+        return;
+    }
+
+    Group group;
+    group.pending = count;
+
+    push(Task{ &body, 0, count, &group });
+
+    while (group.pending > 0) {
+        if (runOne()) {
+            continue;
+        }
+        std::unique_lock lock(_sleepLock);
+        _sleeping++;
+        _wake.wait(lock, [this, &group]() {
+            return _queued > 0 || group.pending == 0;
+        });
+        _sleeping--;
+    }
+
+    if (group.error) {
+        std::rethrow_exception(group.error);
+    }
+}
+
+void TaskScheduler::spawn(std::function<void()> job) {
+    if (_workerCount <= 1) {
+        try {
+            job();
+        } catch (...) {
+        }
+        return;
+    }
+
+    auto* group = new Group;
+    group->pending = 1;
+    group->job = [job = std::move(job)](size_t) {
+        job();
+    };
+    push(Task{ &group->job, 0, 1, group });
+}
+
+void configureScheduler(size_t workers, bool pinThreads) {
+    bool created = false;
+    std::call_once(sharedSchedulerCreated, [&]() {
+        sharedScheduler = std::make_unique<TaskScheduler>(workers, pinThreads);
+        created = true;
+    });
+    if (!created) {
+        throw std::logic_error("Scheduler already configured");
+    }
+}
+
+TaskScheduler& scheduler() {
+    std::call_once(sharedSchedulerCreated, []() {
+        sharedScheduler = std::make_unique<TaskScheduler>(0, false);
+    });
+    return *sharedScheduler;
+}
+
+size_t workerCount() {
+    return scheduler().workerCount();
+}
+
+void parallelFor(size_t count, const std::function<void(size_t)>& body) {
+    scheduler().parallelFor(count, body);
+}
+
+void spawn(std::function<void()> job) {
+    scheduler().spawn(std::move(job));
+}
@@ -0,0 +1,76 @@
+#pragma once
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <thread>
+#include <vector>
+
+// Work-stealing task scheduler. Every thread owns a deque of tasks, taking work from
+// its back and stealing from the front of other deques when empty. Threads waiting
+// for a fork/join group keep running tasks, so groups nest freely, and sleep when
+// there are none.
+struct TaskScheduler {
+    TaskScheduler(size_t workers, bool pinThreads);
+    ~TaskScheduler();
+
+    TaskScheduler(const TaskScheduler&) = delete;
+    TaskScheduler& operator=(const TaskScheduler&) = delete;
+
+    size_t workerCount() const {
+        return _workerCount;
+    }
+
+    void parallelFor(size_t count, const std::function<void(size_t)>& body);
+    void spawn(std::function<void()> job);
+
+   private:
+    struct Group;
+
+    struct Task {
+        const std::function<void(size_t)>* body;
+        size_t begin;
+        size_t end;
+        Group* group;
+    };
+
+    struct Queue {
+        std::mutex lock;
+        std::deque<Task> tasks;
+    };
+
+    void workerLoop(size_t index);
+    void push(const Task& task);
+    bool runOne();
+    void execute(Task task);
+
+    const size_t _workerCount;
+    // Queue 0 is shared by threads outside the pool
+    std::vector<std::unique_ptr<Queue>> _queues;
+    std::vector<std::thread> _threads;
+
+    std::atomic<size_t> _queued{ 0 };
+    std::atomic<bool> _stopping{ false };
+    std::atomic<size_t> _sleeping{ 0 };
+    std::mutex _sleepLock;
+    std::condition_variable _wake;
+};
+
+// Sets up the shared scheduler, must be called before any parallel work.
+// A worker count of 0 uses all cores.
+void configureScheduler(size_t workers, bool pinThreads);
+TaskScheduler& scheduler();
+
+size_t workerCount();
+
+// Runs body(0) .. body(count - 1) on the shared scheduler, returning when all calls are done.
+// The first exception thrown by any call is rethrown.
+void parallelFor(size_t count, const std::function<void(size_t)>& body);
+
+// Queues a job on the shared scheduler without waiting for it. Jobs handle their own
+// errors, anything they throw is dropped. With a single worker, the job runs right away.
+void spawn(std::function<void()> job);
@@ -0,0 +1,22 @@
+#pragma once
+#include <cstdint>
+
+// RGBA pixel, laid out like the pixels of tigr bitmaps
+struct Pixel {
+    uint8_t r;
+    uint8_t g;
+    uint8_t b;
+    uint8_t a;
+};
+
+constexpr Pixel rgb(uint8_t r, uint8_t g, uint8_t b) {
+    return Pixel{ r, g, b, 255 };
+}
+
+// RGBA pixels in rows, stride pixels apart
+struct RGBAView {
+    const Pixel* pixels;
+    int width;
+    int height;
+    int stride;
+};
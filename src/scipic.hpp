@@ -34,31 +34,39 @@ enum SCIExtendedCommandCode {
     setPriorityBands = 8,
 };
 
+// clang-format off
+#define SCI_COLORS \
+    {0x0,0x0}, {0x1,0x1}, {0x2,0x2}, {0x3,0x3}, {0x4,0x4}, {0x5,0x5}, {0x6,0x6}, {0x7,0x7}, \
+    {0x8,0x8}, {0x9,0x9}, {0xa,0xa}, {0xb,0xb}, {0xc,0xc}, {0xd,0xd}, {0xe,0xe}, {0x8,0x8}, \
+    {0x8,0x8}, {0x0,0x1}, {0x0,0x2}, {0x0,0x3}, {0x0,0x4}, {0x0,0x5}, {0x0,0x6}, {0x8,0x8}, \
+    {0x8,0x8}, {0xf,0x9}, {0xf,0xa}, {0xf,0xb}, {0xf,0xc}, {0xf,0xd}, {0xf,0xe}, {0xf,0xf}, \
+    {0x0,0x8}, {0x9,0x1}, {0x2,0xa}, {0x3,0xb}, {0x4,0xc}, {0x5,0xd}, {0x6,0xe}, {0x8,0x8}
+// clang-format on
+
+const PaletteColor defaultSCIPalette[] = { SCI_COLORS, SCI_COLORS, SCI_COLORS, SCI_COLORS };
+
 constexpr uint8_t patternFlagRectangle = 0x10;
 constexpr uint8_t patternFlagUsePattern = 0x20;
 
+// Picture coordinates fit in 16 bits, keeping points small in bulk geometry
 struct Point {
     Point() = default;
     Point(const Point& other) = default;
     Point& operator=(const Point& other) = default;
 
-    Point(int x, int y) : x(x), y(y) {
-    }
-
-    Point(int x, int y, int color) : x(x), y(y), color(color) {
+    Point(int x, int y) : x(int16_t(x)), y(int16_t(y)) {
     }
 
     bool operator==(const Point& other) const {
-        return x == other.x && y == other.y && color == other.color;
+        return x == other.x && y == other.y;
     }
 
     bool empty() const {
-        return x == -1 && y == -1 && color == -1;
+        return x == -1 && y == -1;
     }
 
-    int x{ -1 };
-    int y{ -1 };
-    int color{ -1 };
+    int16_t x{ -1 };
+    int16_t y{ -1 };
 };
 
 struct SCICommand {
@@ -1,5 +1,6 @@
 #include "scipicencoder.hpp"
 #include <cassert>
+#include <cstdlib>
 
 std::vector<uint8_t> encodeCoordinate(int x, int y) {
     const int upperX = x & 0xf00;
@@ -183,8 +184,12 @@ void encodeMultiLine(std::span<const Point> coordinates, std::vector<SCICommand>
     }
 }
 
+SCICommand encodePattern(uint8_t patternFlags) {
+    return SCICommand{ .code = SCICommandCode::setPattern, .params = { patternFlags } };
+}
+
 SCICommand encodeSolidCirclePattern(uint8_t size) {
-    return SCICommand{ .code = SCICommandCode::setPattern, .params = { size } };
+    return encodePattern(size);
 }
 
 void encodePatterns(std::span<const Point> coordinates, std::vector<SCICommand>& sink) {
@@ -209,33 +214,238 @@ SCICommand encodeFill(int x, int y) {
     return SCICommand{ .code = SCICommandCode::floodFill, .params = encodeCoordinate(x, y) };
 }
 
+namespace {
+
+constexpr size_t entirePaletteSize = 3 + paletteSize;
+
+bool locksPaletteEntry(std::span<const PaletteColor> colors, size_t index) {
+    // Entries set in the first palette lock that entry for all four palettes
+    for (size_t locked = index + paletteSize; locked < colors.size(); locked += paletteSize) {
+        if (colors[locked] != colors[index]) {
+            return true;
+        }
+    }
+    return false;
+}
+
+}  // namespace
+
 void encodeColors(const Palette& palette, std::vector<SCICommand>& sink) {
     auto colors = palette.colors();
-    int colorsLeft = colors.size();
-    int colorIndex = 0;
-    int paletteIndex = 0;
-
-    while (colorsLeft >= 40) {
-        std::vector<uint8_t> params{ SCIExtendedCommandCode::setEntirePalette };
-        params.push_back(paletteIndex);
-        const auto paletteColors = colors.subspan(paletteIndex * 40, 40);
-        for (const auto color : paletteColors) {
-            uint8_t colorValue = (color.first << 4) | color.second;
-            params.push_back(colorValue);
+
+    for (size_t paletteIndex = 0; paletteIndex * paletteSize < colors.size(); paletteIndex++) {
+        const auto base = paletteIndex * paletteSize;
+        const auto paletteColors = colors.subspan(base, std::min(paletteSize, colors.size() - base));
+
+        std::vector<uint8_t> entries{ SCIExtendedCommandCode::setPaletteEntries };
+        bool entriesAllowed = true;
+
+        for (size_t i = base; const auto& color : paletteColors) {
+            if (color != defaultSCIPalette[i]) {
+                entries.push_back(i);
+                entries.push_back((color.first << 4) | color.second);
+                if (paletteIndex == 0 && locksPaletteEntry(colors, i)) {
+                    entriesAllowed = false;
+                }
+            }
+            i++;
+        }
+
+        const bool complete = paletteColors.size() == paletteSize;
+
+        if (complete && (!entriesAllowed || entries.size() + 1 >= entirePaletteSize)) {
+            std::vector<uint8_t> params{ SCIExtendedCommandCode::setEntirePalette };
+            params.push_back(paletteIndex);
+            for (const auto& color : paletteColors) {
+                uint8_t colorValue = (color.first << 4) | color.second;
+                params.push_back(colorValue);
+            }
+            sink.push_back(SCICommand{ .code = SCICommandCode::extendedCommand, .params = params });
+        } else if (entries.size() > 1) {
+            assert(entriesAllowed);
+            sink.push_back(SCICommand{ .code = SCICommandCode::extendedCommand, .params = entries });
+        }
+    }
+}
+
+size_t encodedSize(std::span<const SCICommand> commands) {
+    size_t totalBytes = 0;
+    for (const auto& command : commands) {
+        totalBytes += command.params.size() + 1;
+    }
+    return totalBytes;
+}
+
+namespace {
+
+bool isLineCommand(SCICommandCode code) {
+    return code == shortRelativeLines || code == mediumRelativeLines || code == longLines;
+}
+
+bool isPatternCommand(SCICommandCode code) {
+    return code == shortRelativePatterns || code == mediumRelativePatterns || code == longPatterns;
+}
+
+bool isDrawingCommand(SCICommandCode code) {
+    return isLineCommand(code) || isPatternCommand(code) || code == SCICommandCode::floodFill;
+}
+
+Point decodeCoordinate(std::span<const uint8_t> data) {
+    assert(data.size() >= 3);
+    return Point(((data[0] & 0xf0) << 4) | data[1], ((data[0] & 0x0f) << 8) | data[2]);
+}
+
+// Decodes the positions of a line or pattern command, which must not carry pattern codes
+std::vector<Point> decodePositions(const SCICommand& command) {
+    const auto params = std::span(command.params);
+    std::vector<Point> positions;
+
+    switch (command.code) {
+        case longLines:
+        case longPatterns:
+            for (size_t i = 0; i + 3 <= params.size(); i += 3) {
+                positions.push_back(decodeCoordinate(params.subspan(i)));
+            }
+            break;
+
+        case shortRelativeLines:
+        case shortRelativePatterns: {
+            auto p = decodeCoordinate(params);
+            positions.push_back(p);
+            for (const uint8_t v : params.subspan(3)) {
+                const int xOffset = (v & 0x80) != 0 ? -((v & 0x70) >> 4) : (v >> 4);
+                const int yOffset = (v & 0x08) != 0 ? -(v & 7) : (v & 7);
+                p = Point(p.x + xOffset, p.y + yOffset);
+                positions.push_back(p);
+            }
+        } break;
+
+        case mediumRelativeLines:
+        case mediumRelativePatterns: {
+            auto p = decodeCoordinate(params);
+            positions.push_back(p);
+            for (size_t i = 3; i + 2 <= params.size(); i += 2) {
+                const uint8_t yValue = params[i];
+                const int yOffset = (yValue & 0x80) != 0 ? -(yValue & 0x7f) : yValue;
+                const int xOffset = static_cast<int8_t>(params[i + 1]);
+                p = Point(p.x + xOffset, p.y + yOffset);
+                positions.push_back(p);
+            }
+        } break;
+
+        default:
+            assert(false);
+    }
+
+    return positions;
+}
+
+// Drops state changes that are redundant or overridden before anything is drawn
+void removeRedundantState(std::vector<SCICommand>& commands) {
+    std::vector<SCICommand> kept;
+    int visualColor = -1;
+    int patternFlags = -1;
+
+    for (size_t i = 0; i < commands.size(); i++) {
+        auto& command = commands[i];
+
+        if (command.code == setVisualColor || command.code == setPattern) {
+            const int value = command.params.front();
+            auto& current = command.code == setVisualColor ? visualColor : patternFlags;
+            if (value == current) {
+                continue;
+            }
+
+            bool overridden = false;
+            for (size_t j = i + 1; j < commands.size(); j++) {
+                const auto code = commands[j].code;
+                if (code == command.code) {
+                    overridden = true;
+                    break;
+                }
+                const bool usesState = command.code == setVisualColor ? isDrawingCommand(code) : isPatternCommand(code);
+                if (usesState || code == extendedCommand) {
+                    break;
+                }
+            }
+            if (overridden) {
+                continue;
+            }
+
+            current = value;
+        } else if (command.code == extendedCommand) {
+            // Palette changes affect how visual colors resolve
+            visualColor = -1;
+        }
+
+        kept.push_back(std::move(command));
+    }
+
+    std::swap(kept, commands);
+}
+
+bool mergeCommands(std::vector<SCICommand>& sink, const SCICommand& next, int patternFlags) {
+    auto& previous = sink.back();
+
+    if (previous.code == SCICommandCode::floodFill && next.code == SCICommandCode::floodFill) {
+        previous.params.insert(previous.params.end(), next.params.begin(), next.params.end());
+        return true;
+    }
+
+    const bool lines = isLineCommand(previous.code) && isLineCommand(next.code);
+    const bool patterns = isPatternCommand(previous.code) && isPatternCommand(next.code) && patternFlags >= 0 &&
+                          (patternFlags & patternFlagUsePattern) == 0;
+
+    if (!lines && !patterns) {
+        return false;
+    }
+
+    auto positions = decodePositions(previous);
+    const auto nextPositions = decodePositions(next);
+
+    if (lines) {
+        // Line commands can only continue from where the previous one ended
+        if (!(positions.back() == nextPositions.front())) {
+            return false;
         }
-        sink.push_back(SCICommand{ .code = SCICommandCode::extendedCommand, .params = params });
-        colorsLeft -= 40;
-        paletteIndex++;
-    }
-
-    {
-        std::vector<uint8_t> params{ SCIExtendedCommandCode::setPaletteEntries };
-        const auto remainder = colors.subspan(paletteIndex * 40);
-        for (int i = paletteIndex * 40; const auto& color : remainder) {
-            params.push_back(i++);
-            uint8_t colorValue = (color.first << 4) | color.second;
-            params.push_back(colorValue);
+        positions.insert(positions.end(), nextPositions.begin() + 1, nextPositions.end());
+    } else {
+        positions.insert(positions.end(), nextPositions.begin(), nextPositions.end());
+    }
+
+    std::vector<SCICommand> merged;
+    if (lines) {
+        encodeMultiLine(positions, merged);
+    } else {
+        encodePatterns(positions, merged);
+    }
+
+    if (encodedSize(merged) >= encodedSize(std::span(&previous, 1)) + encodedSize(std::span(&next, 1))) {
+        return false;
+    }
+
+    sink.pop_back();
+    sink.insert(sink.end(), merged.begin(), merged.end());
+    return true;
+}
+
+}  // namespace
+
+void optimizeCommands(std::vector<SCICommand>& commands) {
+    removeRedundantState(commands);
+
+    std::vector<SCICommand> merged;
+    int patternFlags = -1;
+
+    for (auto& command : commands) {
+        if (command.code == setPattern) {
+            patternFlags = command.params.front();
+        }
+        if (!merged.empty() && mergeCommands(merged, command, patternFlags)) {
+            continue;
         }
-        sink.push_back(SCICommand{ .code = SCICommandCode::extendedCommand, .params = params });
+        merged.push_back(std::move(command));
     }
-}
\ No newline at end of file
+
+    std::swap(merged, commands);
+}
@@ -3,8 +3,11 @@
 
 std::vector<uint8_t> encodeCoordinate(int x, int y);
 SCICommand encodeVisual(uint8_t color);
+SCICommand encodePattern(uint8_t patternFlags);
 SCICommand encodeSolidCirclePattern(uint8_t size);
 void encodeMultiLine(std::span<const Point> coordinates, std::vector<SCICommand>& sink);
 void encodePatterns(std::span<const Point> coordinates, std::vector<SCICommand>& sink);
 SCICommand encodeFill(int x, int y);
 void encodeColors(const Palette& colors, std::vector<SCICommand>& sink);
+size_t encodedSize(std::span<const SCICommand> commands);
+void optimizeCommands(std::vector<SCICommand>& commands);
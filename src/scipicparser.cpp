@@ -1,4 +1,5 @@
 #include "scipicparser.hpp"
+#include "scipicpattern.hpp"
 #include <sstream>
 #include <set>
 
@@ -36,7 +37,8 @@ std::string hex(int value) {
 
 }  // namespace
 
-void SCIPicParser::parse(int limit) {
+template <typename Size>
+void BasicSCIPicParser<Size>::parse(int limit) {
     reset();
 
     if (peek(0) != 0x81 || peek(1) != 0x00) {
@@ -142,36 +144,42 @@ void SCIPicParser::parse(int limit) {
 
 /// Data stream stuff
 
-std::uint8_t SCIPicParser::peek(size_t offset) const {
+template <typename Size>
+std::uint8_t BasicSCIPicParser<Size>::peek(size_t offset) const {
     if (_pos + offset < _data.size()) {
         return _data[_pos + offset];
     }
     throw std::runtime_error("Unexpected end of pic");
 }
 
-std::uint8_t SCIPicParser::read() {
+template <typename Size>
+std::uint8_t BasicSCIPicParser<Size>::read() {
     if (_pos < _data.size()) {
         return _data[_pos++];
     }
     throw std::runtime_error("Unexpected end of pic");
 }
 
-bool SCIPicParser::atEnd() const {
+template <typename Size>
+bool BasicSCIPicParser<Size>::atEnd() const {
     return _pos >= _data.size();
 }
 
-void SCIPicParser::reset() {
+template <typename Size>
+void BasicSCIPicParser<Size>::reset() {
     _pos = 0;
     _lockedColors.clear();
 }
 
-void SCIPicParser::skip(size_t count) {
+template <typename Size>
+void BasicSCIPicParser<Size>::skip(size_t count) {
     _pos += count;
 }
 
 /// Drawing
 
-void SCIPicParser::drawLine(int x0, int y0, int x1, int y1) {
+template <typename Size>
+void BasicSCIPicParser<Size>::drawLine(int x0, int y0, int x1, int y1) {
     if (!_visualEnabled || !_drawLines) {
         return;
     }
@@ -198,11 +206,13 @@ void SCIPicParser::drawLine(int x0, int y0, int x1, int y1) {
     }
 }
 
-void SCIPicParser::plot(int x, int y) {
+template <typename Size>
+void BasicSCIPicParser<Size>::plot(int x, int y) {
     _bmp.put(x, y, effectiveColor(_color, x, y));
 }
 
-void SCIPicParser::floodFill(int x, int y) {
+template <typename Size>
+void BasicSCIPicParser<Size>::floodFill(int x, int y) {
     if (!_visualEnabled || !_drawFills) {
         return;
     }
@@ -214,20 +224,21 @@ void SCIPicParser::floodFill(int x, int y) {
         return;
     }
 
+    const int width = _bmp.width();
     std::vector<Point> fills;
-    std::set<std::pair<int, int>> filled;
+    std::vector<bool> filled(width * _bmp.height());
 
     auto effective = effectiveColor(_color, x, y);
     _bmp.put(x, y, effective);
     fills.push_back({ x, y });
-    filled.insert({ x, y });
+    filled[y * width + x] = true;
 
-    const auto check = [this, &fills, &filled](int x, int y) {
-        if (x < 0 || x >= _bmp.width() || y < 0 || y >= _bmp.height()) {
+    const auto check = [this, width, &fills, &filled](int x, int y) {
+        if (x < 0 || x >= width || y < 0 || y >= _bmp.height()) {
             return;
         }
 
-        if (filled.contains({ x, y })) {
+        if (filled[y * width + x]) {
             return;
         }
 
@@ -235,7 +246,7 @@ void SCIPicParser::floodFill(int x, int y) {
             _bmp.put(x, y, effectiveColor(_color, x, y));
             fills.push_back({ x, y });
         }
-        filled.insert({ x, y });
+        filled[y * width + x] = true;
     };
 
     while (!fills.empty()) {
@@ -257,25 +268,6 @@ void SCIPicParser::floodFill(int x, int y) {
 namespace {
 // clang-format off
 
-constexpr std::array<uint8_t, 30> circlePatterns[] = {
-    { 0x80 },
-    { 0x4e, 0x40 },
-    { 0x73, 0xef, 0xbe, 0x70 },
-    { 0x38, 0x7c, 0xfe, 0xfe, 0xfe, 0x7c, 0x38, 0x00 },
-    { 0x1c, 0x1f, 0xcf, 0xfb, 0xfe, 0xff, 0xbf, 0xef,
-      0xf9, 0xfc, 0x1c },
-    { 0x0e, 0x03, 0xf8, 0x7f, 0xc7, 0xfc, 0xff, 0xef,
-      0xfe, 0xff, 0xe7, 0xfc, 0x7f, 0xc3, 0xf8, 0x1f,
-      0x00 },
-    { 0x0f, 0x80, 0xff, 0x87, 0xff, 0x1f, 0xfc, 0xff,
-      0xfb, 0xff, 0xef, 0xff, 0xbf, 0xfe, 0xff, 0xf9,
-      0xff, 0xc7, 0xff, 0x0f, 0xf8, 0x0f, 0x80 },
-    { 0x07, 0xc0, 0x1f, 0xf0, 0x3f, 0xf8, 0x7f, 0xfc,
-      0x7f, 0xfc, 0xff, 0xfe, 0xff, 0xfe, 0xff, 0xfe,
-      0xff, 0xfe, 0xff, 0xfe, 0x7f, 0xfc, 0x7f, 0xfc,
-      0x3f, 0xf8, 0x1f, 0xf0, 0x07, 0xc0 }
-};
-
 std::array<uint8_t, 32> patternData {
     0x20, 0x94, 0x02, 0x24, 0x90, 0x82, 0xa4, 0xa2,
     0x82, 0x09, 0x0a, 0x22, 0x12, 0x10, 0x42, 0x14,
@@ -304,15 +296,16 @@ std::array<uint8_t, 128> patternIndicies {
 // clang-format on
 }  // namespace
 
-void SCIPicParser::drawPattern(int x, int y, int pattern) {
+template <typename Size>
+void BasicSCIPicParser<Size>::drawPattern(int x, int y, int pattern) {
     if (!_visualEnabled || !_drawPatterns) {
         return;
     }
 
     int size = _patternFlags & 0x7;
 
-    x = std::clamp(x, size, 319 - size);
-    y = std::clamp(y, size, 189 - size);
+    x = std::clamp(x, size, _bmp.width() - 1 - size);
+    y = std::clamp(y, size, _bmp.height() - 1 - size);
 
     int patternIndex = (pattern >> 1) & 0x7f;
     if (patternIndex >= patternIndicies.size()) {
@@ -365,7 +358,8 @@ void SCIPicParser::drawPattern(int x, int y, int pattern) {
 
 /// Parsing
 
-std::pair<int, int> SCIPicParser::readCoordinate() {
+template <typename Size>
+std::pair<int, int> BasicSCIPicParser<Size>::readCoordinate() {
     const auto upperXY = read();
     const auto lowerX = read();
     const auto lowerY = read();
@@ -375,11 +369,13 @@ std::pair<int, int> SCIPicParser::readCoordinate() {
     return coord;
 }
 
-bool SCIPicParser::nextIsCommand() const {
+template <typename Size>
+bool BasicSCIPicParser<Size>::nextIsCommand() const {
     return peek(0) >= 0xf0;
 }
 
-void SCIPicParser::parseShortRelativeLines() {
+template <typename Size>
+void BasicSCIPicParser<Size>::parseShortRelativeLines() {
     auto first = readCoordinate();
 
     do {
@@ -389,7 +385,8 @@ void SCIPicParser::parseShortRelativeLines() {
     } while (!nextIsCommand());
 }
 
-void SCIPicParser::parseMediumRelativeLines() {
+template <typename Size>
+void BasicSCIPicParser<Size>::parseMediumRelativeLines() {
     auto first = readCoordinate();
 
     do {
@@ -399,14 +396,15 @@ void SCIPicParser::parseMediumRelativeLines() {
         const auto y0 = first.second;
         auto x1 = x0 + xOffset;
         auto y1 = y0 + yOffset;
-        x1 = std::clamp(x1, 0, 319);
-        y1 = std::clamp(y1, 0, 189);
+        x1 = std::clamp(x1, 0, _bmp.width() - 1);
+        y1 = std::clamp(y1, 0, _bmp.height() - 1);
         drawLine(x0, y0, x1, y1);
         first = { x1, y1 };
     } while (!nextIsCommand());
 }
 
-void SCIPicParser::parseLongLines() {
+template <typename Size>
+void BasicSCIPicParser<Size>::parseLongLines() {
     auto first = readCoordinate();
 
     while (!nextIsCommand()) {
@@ -416,7 +414,8 @@ void SCIPicParser::parseLongLines() {
     }
 }
 
-void SCIPicParser::parseShortRelativePatterns() {
+template <typename Size>
+void BasicSCIPicParser<Size>::parseShortRelativePatterns() {
     uint8_t pattern = 0;
     if ((_patternFlags & patternFlagUsePattern) != 0) {
         pattern = read();
@@ -435,7 +434,8 @@ void SCIPicParser::parseShortRelativePatterns() {
     }
 }
 
-void SCIPicParser::parseMediumRelativePatterns() {
+template <typename Size>
+void BasicSCIPicParser<Size>::parseMediumRelativePatterns() {
     uint8_t pattern = 0;
     if ((_patternFlags & patternFlagUsePattern) != 0) {
         pattern = read();
@@ -458,7 +458,8 @@ void SCIPicParser::parseMediumRelativePatterns() {
     }
 }
 
-void SCIPicParser::parseLongPatterns() {
+template <typename Size>
+void BasicSCIPicParser<Size>::parseLongPatterns() {
     while (!nextIsCommand()) {
         uint8_t pattern = 0;
         if ((_patternFlags & patternFlagUsePattern) != 0) {
@@ -470,14 +471,16 @@ void SCIPicParser::parseLongPatterns() {
     }
 }
 
-void SCIPicParser::parseFloodFill() {
+template <typename Size>
+void BasicSCIPicParser<Size>::parseFloodFill() {
     while (!nextIsCommand()) {
         auto position = readCoordinate();
         floodFill(position.first, position.second);
     }
 }
 
-void SCIPicParser::parseExtended(uint8_t cmd) {
+template <typename Size>
+void BasicSCIPicParser<Size>::parseExtended(uint8_t cmd) {
     switch (cmd) {
         case setPaletteEntries: {
             while (_pos <= _data.size() && !nextIsCommand()) {
@@ -510,4 +513,7 @@ void SCIPicParser::parseExtended(uint8_t cmd) {
         default:
             throw std::runtime_error("Unhandled extended command " + hex(cmd));
     }
-}
\ No newline at end of file
+}
+
+template struct BasicSCIPicParser<PicExtent>;
+template struct BasicSCIPicParser<DynamicExtent>;
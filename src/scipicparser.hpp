@@ -5,28 +5,18 @@
 #include <vector>
 #include <cassert>
 
-#include "tigr.h"
 #include "image.hpp"
 #include "scipic.hpp"
 
-// clang-format off
-#define SCI_COLORS \
-    {0x0,0x0}, {0x1,0x1}, {0x2,0x2}, {0x3,0x3}, {0x4,0x4}, {0x5,0x5}, {0x6,0x6}, {0x7,0x7}, \
-    {0x8,0x8}, {0x9,0x9}, {0xa,0xa}, {0xb,0xb}, {0xc,0xc}, {0xd,0xd}, {0xe,0xe}, {0x8,0x8}, \
-    {0x8,0x8}, {0x0,0x1}, {0x0,0x2}, {0x0,0x3}, {0x0,0x4}, {0x0,0x5}, {0x0,0x6}, {0x8,0x8}, \
-    {0x8,0x8}, {0xf,0x9}, {0xf,0xa}, {0xf,0xb}, {0xf,0xc}, {0xf,0xd}, {0xf,0xe}, {0xf,0xf}, \
-    {0x0,0x8}, {0x9,0x1}, {0x2,0xa}, {0x3,0xb}, {0x4,0xc}, {0x5,0xd}, {0x6,0xe}, {0x8,0x8}
-// clang-format on
-
-const PaletteColor defaultSCIPalette[] = { SCI_COLORS, SCI_COLORS, SCI_COLORS, SCI_COLORS };
-
-struct SCIPicParser {
-    SCIPicParser(std::span<const uint8_t> data) : _data(data), _bmp(320, 190), _palette(defaultSCIPalette) {
+template <typename Size>
+struct BasicSCIPicParser {
+    BasicSCIPicParser(std::span<const uint8_t> data, int width = picWidth, int height = picHeight)
+        : _data(data), _bmp(width, height), _palette(defaultSCIPalette) {
     }
 
     void parse(int limit = -1);
-    auto bitmap() {
-        return _bmp.asBitmap();
+    const BasicEGAImage<Size>& image() const {
+        return _bmp;
     }
     const auto& palette() const {
         return _palette;
@@ -67,5 +57,8 @@ struct SCIPicParser {
     uint8_t _patternFlags{ 0 };
     Palette _palette;
     std::set<uint8_t> _lockedColors;
-    EGAImage _bmp;
+    BasicEGAImage<Size> _bmp;
 };
+
+using SCIPicParser = BasicSCIPicParser<PicExtent>;
+using DynamicSCIPicParser = BasicSCIPicParser<DynamicExtent>;
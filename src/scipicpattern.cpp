@@ -0,0 +1,43 @@
+#include "scipicpattern.hpp"
+#include <cassert>
+
+// clang-format off
+const std::array<uint8_t, 30> circlePatterns[maxPatternSize + 1] = {
+    { 0x80 },
+    { 0x4e, 0x40 },
+    { 0x73, 0xef, 0xbe, 0x70 },
+    { 0x38, 0x7c, 0xfe, 0xfe, 0xfe, 0x7c, 0x38, 0x00 },
+    { 0x1c, 0x1f, 0xcf, 0xfb, 0xfe, 0xff, 0xbf, 0xef,
+      0xf9, 0xfc, 0x1c },
+    { 0x0e, 0x03, 0xf8, 0x7f, 0xc7, 0xfc, 0xff, 0xef,
+      0xfe, 0xff, 0xe7, 0xfc, 0x7f, 0xc3, 0xf8, 0x1f,
+      0x00 },
+    { 0x0f, 0x80, 0xff, 0x87, 0xff, 0x1f, 0xfc, 0xff,
+      0xfb, 0xff, 0xef, 0xff, 0xbf, 0xfe, 0xff, 0xf9,
+      0xff, 0xc7, 0xff, 0x0f, 0xf8, 0x0f, 0x80 },
+    { 0x07, 0xc0, 0x1f, 0xf0, 0x3f, 0xf8, 0x7f, 0xfc,
+      0x7f, 0xfc, 0xff, 0xfe, 0xff, 0xfe, 0xff, 0xfe,
+      0xff, 0xfe, 0xff, 0xfe, 0x7f, 0xfc, 0x7f, 0xfc,
+      0x3f, 0xf8, 0x1f, 0xf0, 0x07, 0xc0 }
+};
+// clang-format on
+
+int patternSize(uint8_t patternFlags) {
+    return patternFlags & 0x7;
+}
+
+bool patternCovers(uint8_t patternFlags, int dx, int dy) {
+    assert((patternFlags & patternFlagUsePattern) == 0);
+
+    const int size = patternSize(patternFlags);
+    if (dx < -size || dx > size + 1 || dy < -size || dy > size) {
+        return false;
+    }
+
+    if ((patternFlags & patternFlagRectangle) != 0) {
+        return true;
+    }
+
+    const int circleBit = (dy + size) * (2 * size + 2) + dx + size;
+    return ((circlePatterns[size][circleBit >> 3] >> (7 - (circleBit & 7))) & 1) != 0;
+}
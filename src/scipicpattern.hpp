@@ -0,0 +1,31 @@
+#pragma once
+#include <array>
+#include <cstdint>
+
+#include "scipic.hpp"
+
+constexpr int maxPatternSize = 7;
+
+extern const std::array<uint8_t, 30> circlePatterns[maxPatternSize + 1];
+
+// Pattern stamps span [-size, size + 1] horizontally and [-size, size] vertically
+// around the pattern position.
+int patternSize(uint8_t patternFlags);
+bool patternCovers(uint8_t patternFlags, int dx, int dy);
+
+// Calls plot(x, y) for the pixels a pattern stamp covers within a width x height image
+template <typename Plot>
+void plotPattern(int x, int y, uint8_t patternFlags, int width, int height, const Plot& plot) {
+    const int size = patternSize(patternFlags);
+
+    for (int py = y - size; py <= y + size; py++) {
+        for (int px = x - size; px <= x + size + 1; px++) {
+            if (px < 0 || px >= width || py < 0 || py >= height) {
+                continue;
+            }
+            if (patternCovers(patternFlags, px - x, py - y)) {
+                plot(px, py);
+            }
+        }
+    }
+}
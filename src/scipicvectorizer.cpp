@@ -1,11 +1,19 @@
 #include "scipicvectorizer.hpp"
 #include "scipicencoder.hpp"
+#include "scipicpattern.hpp"
+#include "parallel.hpp"
+#include "kernels.hpp"
+#include "hash.hpp"
 #include <cassert>
+#include <algorithm>
 #include <span>
+#include <array>
 #include <ranges>
 #include <set>
 #include <map>
 #include <vector>
+#include <optional>
+#include <numeric>
 
 bool PixelArea::solid() const {
     int lastRow = -1;
@@ -23,255 +31,343 @@ bool PixelArea::solid() const {
 void PixelArea::fillWithLines() {
     // ??? Simple, stupid line fill
     for (const auto& run : _runs) {
-        Line l;
+        Line l(_lines.get_allocator());
         l.add(Point(run.start, run.row));
         l.add(Point(run.start + run.length - 1, run.row));
         _lines.push_back(l);
     }
 }
 
-void PixelArea::traceLines(const ByteImage& source) {
-    if (_runs.empty()) {
-        return;
+void PixelArea::optimizeLines() {
+    for (auto& line : _lines) {
+        line.optimize();
     }
+}
 
-    Line line;
-
-    if (_runs.size() == 1) {
-        auto run = _runs.front();
-        line.add(Point(run.start, run.row, run.color));
-        line.add(Point(run.start + run.length - 1, run.row, run.color));
-        _lines.push_back(line);
+void Line::optimize() {
+    if (_points.size() < 3) {
         return;
     }
+    std::pmr::vector<Point> optimized(_points.get_allocator());
+
+    optimized.push_back(_points.front());
+    auto candidate = _points[1];
+
+    for (const auto& nextPoint : std::span(_points).subspan(2)) {
+        const auto& p0 = optimized.back();
+
+        if (candidate == p0) {
+            candidate = nextPoint;
+            continue;
+        }
+
+        auto xDiff = candidate.x - p0.x;
+        auto yDiff = candidate.y - p0.y;
 
-    ByteImage workArea(source.width(), source.height());
+        // Straight continuations only, a line turning back on itself would lose its tip
+        const auto sign = [](int value) {
+            return (value > 0) - (value < 0);
+        };
 
-    int startX = 0;
-    int startY = 0;
-    int color = -1;
+        if (xDiff == 0 && nextPoint.x == p0.x && sign(nextPoint.y - candidate.y) == sign(yDiff)) {
+            candidate = nextPoint;
+        } else if (yDiff == 0 && nextPoint.y == p0.y && sign(nextPoint.x - candidate.x) == sign(xDiff)) {
+            candidate = nextPoint;
+        } else if (abs(xDiff) == 1 && abs(yDiff) == 1 && (nextPoint.x - candidate.x == xDiff) &&
+                   (nextPoint.y - candidate.y == yDiff)) {
+            candidate = nextPoint;
+        } else {
+            optimized.push_back(candidate);
+            candidate = nextPoint;
+        }
+    }
 
-    int minX = _runs.front().start;
-    int maxX = minX;
-    int minY = _runs.front().row;
-    int maxY = minY;
+    optimized.push_back(candidate);
+    std::swap(optimized, _points);
+}
 
-    _runs.sort([](const auto& a, const auto& b) {
-        if (a.row == b.row) {
-            return a.start <= b.start;
+namespace {
+
+struct AreaMask {
+    explicit AreaMask(const std::pmr::list<PixelRun>& runs) {
+        assert(!runs.empty());
+        int right = 0;
+        int bottom = 0;
+        left = runs.front().start;
+        top = runs.front().row;
+
+        for (const auto& run : runs) {
+            left = std::min<int>(left, run.start);
+            right = std::max(right, run.start + run.length - 1);
+            top = std::min<int>(top, run.row);
+            bottom = std::max<int>(bottom, run.row);
         }
-        return a.row < b.row;
-    });
 
-    for (auto& run : _runs) {
-        int thisRow = run.row;
-        int thisStart = run.start;
-        int thisEnd = run.start + run.length - 1;
-        int thisColor = run.color;
+        width = right - left + 1;
+        height = bottom - top + 1;
+        bits.resize(width * height, 0);
 
-        if (color == -1) {
-            color = thisColor;
-            // "+1" makes sure we use a unique new color
-            workArea.clear(color + 1);
+        for (const auto& run : runs) {
+            std::fill_n(bits.begin() + index(run.start, run.row), run.length, 1);
         }
+    }
+
+    size_t index(int x, int y) const {
+        return (y - top) * width + x - left;
+    }
 
-        if (minX > thisStart) {
-            minX = thisStart;
+    bool contains(int x, int y) const {
+        if (x < left || x >= left + width || y < top || y >= top + height) {
+            return false;
         }
-        if (maxX < thisEnd) {
-            maxX = thisEnd;
+        return bits[index(x, y)] != 0;
+    }
+
+    int left;
+    int top;
+    int width;
+    int height;
+    std::vector<uint8_t> bits;
+};
+
+// Seeds for the 4-connected components of background pixels within the area, in
+// run order, and the pixels filling from them covers. Fails if any component
+// touches background outside the area, where a fill would leak.
+template <typename Canvas>
+bool enclosedBackground(const std::pmr::list<PixelRun>& runs,
+    const AreaMask& mask,
+    const Canvas& canvas,
+    uint8_t bg,
+    std::vector<Point>& seeds,
+    std::vector<Point>& pixels) {
+    std::vector<uint8_t> labelled(mask.bits.size(), 0);
+    std::vector<Point> stack;
+    bool leaks = false;
+
+    const auto visit = [&](int x, int y) {
+        if (x < 0 || x >= canvas.width() || y < 0 || y >= canvas.height() || canvas.get(x, y) != bg) {
+            return;
         }
-        if (minY > thisRow) {
-            minY = thisRow;
+        if (!mask.contains(x, y)) {
+            leaks = true;
+            return;
         }
-        if (maxY < thisRow) {
-            maxY = thisRow;
+        if (labelled[mask.index(x, y)] != 0) {
+            return;
         }
+        labelled[mask.index(x, y)] = 1;
+        stack.emplace_back(x, y);
+        pixels.emplace_back(x, y);
+    };
 
-        workArea.put(thisStart, thisRow, thisColor);
+    for (const auto& run : runs) {
+        for (int col = run.start; col < run.start + run.length; col++) {
+            if (labelled[mask.index(col, run.row)] != 0 || canvas.get(col, run.row) != bg) {
+                continue;
+            }
+            seeds.emplace_back(col, run.row);
+            visit(col, run.row);
+
+            while (!stack.empty()) {
+                const auto p = stack.back();
+                stack.pop_back();
+                visit(p.x + 1, p.y);
+                visit(p.x - 1, p.y);
+                visit(p.x, p.y + 1);
+                visit(p.x, p.y - 1);
+            }
 
-        for (int x = thisStart + 1; x < thisEnd; x++) {
-            if ((thisRow == 0 || thisRow == source.height() - 1) || (source.get(x, thisRow - 1) != thisColor) ||
-                (source.get(x, thisRow + 1) != thisColor)) {
-                workArea.put(x, thisRow, thisColor);
+            if (leaks) {
+                return false;
             }
         }
-
-        workArea.put(thisEnd, thisRow, thisColor);
     }
 
-    while (true) {
-        bool found = false;
+    return true;
+}
 
-        for (int searchY = minY; !found && searchY <= maxY; searchY++) {
-            for (int searchX = minX; !found && searchX <= maxX; searchX++) {
-                if (workArea.get(searchX, searchY) == color) {
-                    startX = searchX;
-                    startY = searchY;
-                    found = true;
-                }
-            }
-        }
+// Fills all background within the area, touching the canvas only if every fill stays inside
+template <typename Canvas>
+bool fillBackground(Canvas& canvas,
+    const std::pmr::list<PixelRun>& runs,
+    const AreaMask& mask,
+    uint8_t colorIndex,
+    uint8_t bg,
+    std::pmr::vector<Point>& fills) {
+    std::vector<Point> seeds;
+    std::vector<Point> pixels;
+
+    if (!enclosedBackground(runs, mask, canvas, bg, seeds, pixels)) {
+        return false;
+    }
 
-        if (!found) {
-            break;
-        }
+    const auto& color = canvas.palette().get(colorIndex);
+    if (!seeds.empty() && (color.first == bg || color.second == bg)) {
+        // Filling with the background color would not stop
+        return false;
+    }
 
-        int x = startX;
-        int y = startY;
-        int xDelta = 0;
-        int yDelta = 1;
-        int count = 0;
+    for (const auto& p : pixels) {
+        canvas.put(p.x, p.y, colorIndex);
+    }
+    fills.insert(fills.end(), seeds.begin(), seeds.end());
+    return true;
+}
 
-        const auto safeIsColor = [&workArea, &color](int x, int y) -> bool {
-            if (x < 0 || y < 0 || x >= workArea.width() || y >= workArea.height()) {
-                return false;
-            }
-            return workArea.get(x, y) == color;
-        };
+}  // namespace
 
-        const auto checkDirections = [&x, &y, &xDelta, &yDelta, &safeIsColor]() -> bool {
-            constexpr std::pair<int, int> directions[] = {
-                { -1, 1 }, { 0, 1 }, { 1, 1 }, { 1, 0 }, { 1, -1 }, { 0, -1 }, { -1, -1 }, { -1, 0 }
-            };
-
-            for (const auto& d : directions) {
-                int dx = d.first;
-                int dy = d.second;
-                if (safeIsColor(x + dx, y + dy)) {
-                    x += dx;
-                    y += dy;
-                    xDelta = dx;
-                    yDelta = dy;
-                    return true;
-                }
-            }
-            return false;
-        };
+namespace {
 
-        bool endOfTheLine = false;
+// Moore neighbourhood as chain codes, clockwise from west
+constexpr std::array<std::pair<int, int>, 8> chainSteps{
+    { { -1, 0 }, { -1, -1 }, { 0, -1 }, { 1, -1 }, { 1, 0 }, { 1, 1 }, { 0, 1 }, { -1, 1 } }
+};
 
-        while (!endOfTheLine) {
-            count++;
+int chainCode(int dx, int dy) {
+    const auto step = std::ranges::find(chainSteps, std::pair(dx, dy));
+    assert(step != chainSteps.end());
+    return step - chainSteps.begin();
+}
 
-            line.add(Point(x, y, color));
-            workArea.put(x, y, color + 1);
-            // ???
-            if (count == 3) {
-                workArea.put(startX, startY, color);
-            }
-            if (safeIsColor(x + xDelta, y + yDelta)) {
-                x += xDelta;
-                y += yDelta;
-            } else if (!checkDirections()) {
-                if (x != startX || y != startY) {
-                    _lines.push_back(line);
-                    line.clear();
-                }
-                endOfTheLine = true;
+// Follows the area boundary from start, keeping the background pixel in the
+// backtrack direction on the outside. Moore-neighbour tracing with Jacob's
+// stopping criterion, returning the steps taken as chain codes.
+std::vector<uint8_t> traceContour(const AreaMask& mask, Point start, int backtrack) {
+    std::vector<uint8_t> chain;
+    int x = start.x;
+    int y = start.y;
+    int firstStep = -1;
+
+    // Each pixel is entered at most once from each side
+    const auto maxSteps = 8 * mask.bits.size();
+
+    while (chain.size() < maxSteps) {
+        int step = -1;
+        for (int turn = 1; turn <= 8; turn++) {
+            const auto code = (backtrack + turn) % 8;
+            if (mask.contains(x + chainSteps[code].first, y + chainSteps[code].second)) {
+                step = code;
+                break;
             }
+        }
 
-            workArea.put(startX, startY, color + 1);
-            if (x == startX && y == startY) {
-                line.add(Point(startX, startY, color));
-                _lines.push_back(line);
-                line.clear();
-                _closed = true;
-            }
+        if (step == -1) {
+            // Isolated pixel
+            break;
         }
-    }
 
-    for (int y = minY; y < maxY; y++) {
-        for (int x = minX; x < maxX; x++) {
-            if (x == startX && y == startY) {
-                continue;
+        if (x == start.x && y == start.y) {
+            if (firstStep == -1) {
+                firstStep = step;
+            } else if (step == firstStep) {
+                break;
             }
-            assert(workArea.get(x, y) != color);
         }
+
+        // The last neighbour checked before the step is background
+        const auto& outside = chainSteps[(step + 7) % 8];
+        const auto& move = chainSteps[step];
+        backtrack = chainCode(outside.first - move.first, outside.second - move.second);
+        x += move.first;
+        y += move.second;
+        chain.push_back(step);
     }
+
+    return chain;
 }
 
-void PixelArea::optimizeLines() {
-    for (auto& line : _lines) {
-        line.optimize();
+// Chain code of a 4-neighbour that a fill could leak to, or -1 for interior pixels
+int openSide(const AreaMask& mask, int x, int y, int width, int height) {
+    for (const int code : { 0, 2, 4, 6 }) {
+        const auto nx = x + chainSteps[code].first;
+        const auto ny = y + chainSteps[code].second;
+        if (nx >= 0 && ny >= 0 && nx < width && ny < height && !mask.contains(nx, ny)) {
+            return code;
+        }
     }
+    return -1;
 }
 
-void Line::optimize() {
-    if (_points.size() < 3) {
+}  // namespace
+
+void PixelArea::traceLines(int width, int height) {
+    if (_runs.empty()) {
         return;
     }
-    std::vector<Point> optimized;
 
-    optimized.push_back(_points.front());
-    auto candidate = _points[1];
+    if (_runs.size() == 1) {
+        const auto& run = _runs.front();
+        Line line(_lines.get_allocator());
+        line.add(Point(run.start, run.row));
+        line.add(Point(run.start + run.length - 1, run.row));
+        _lines.push_back(line);
+        return;
+    }
 
-    for (const auto& nextPoint : std::span(_points).subspan(2)) {
-        const auto& p0 = optimized.back();
+    sort();
 
-        if (candidate == p0) {
-            candidate = nextPoint;
-            continue;
-        }
+    // Every pixel next to the outside, including holes, is covered by a contour
+    const AreaMask mask(_runs);
+    std::vector<uint8_t> covered(mask.bits.size(), 0);
 
-        auto xDiff = candidate.x - p0.x;
-        auto yDiff = candidate.y - p0.y;
+    for (const auto& run : _runs) {
+        for (int col = run.start; col < run.start + run.length; col++) {
+            if (covered[mask.index(col, run.row)] != 0) {
+                continue;
+            }
+            const auto backtrack = openSide(mask, col, run.row, width, height);
+            if (backtrack == -1) {
+                continue;
+            }
 
-        if (xDiff == 0 && nextPoint.x == p0.x) {
-            candidate = nextPoint;
-        } else if (yDiff == 0 && nextPoint.y == p0.y) {
-            candidate = nextPoint;
-        } else if (abs(xDiff) == 1 && abs(yDiff) == 1 && (nextPoint.x - candidate.x == xDiff) &&
-                   (nextPoint.y - candidate.y == yDiff)) {
-            candidate = nextPoint;
-        } else {
-            optimized.push_back(candidate);
-            candidate = nextPoint;
+            const auto chain = traceContour(mask, Point(col, run.row), backtrack);
+
+            // Steps back over pixels this contour already covered add nothing at its end
+            covered[mask.index(col, run.row)] = 1;
+            size_t length = 0;
+            Point p(col, run.row);
+            for (size_t i = 0; i < chain.size(); i++) {
+                p = Point(p.x + chainSteps[chain[i]].first, p.y + chainSteps[chain[i]].second);
+                auto& pixel = covered[mask.index(p.x, p.y)];
+                if (pixel == 0) {
+                    pixel = 1;
+                    length = i + 1;
+                }
+            }
+            _closed = _closed || length == chain.size();
+            // Lines need two points
+            length = std::min(std::max<size_t>(length, 1), chain.size());
+
+            Line line(_lines.get_allocator());
+            p = Point(col, run.row);
+            line.add(p);
+            for (const auto code : std::span(chain).first(length)) {
+                p = Point(p.x + chainSteps[code].first, p.y + chainSteps[code].second);
+                line.add(p);
+            }
+            if (chain.empty()) {
+                line.add(p);
+            }
+            _lines.push_back(line);
         }
     }
-
-    optimized.push_back(candidate);
-    std::swap(optimized, _points);
 }
 
-void PixelArea::findFills(PaletteImage& canvas, uint8_t bg) {
+template <typename Canvas>
+void PixelArea::findFills(Canvas& canvas, uint8_t bg) {
     // Remember - our canvas pixel values are indices into the SCI palette.
     // Flood fills are based on areas of same effective color.
 
     const auto c = color();
-
-    PaletteImage workArea(canvas);
-
-    bool fillOK = true;
+    const AreaMask mask(_runs);
 
     // First, try to fill without drawing lines
-    for (const auto& run : _runs) {
-        const int row = run.row;
-        for (int col = run.start; col < run.start + run.length; col++) {
-            if (workArea.get(col, row) == bg) {
-                fillOK = workArea.fillWhere(col, row, c, bg, [this](int x, int y) {
-                    return contains(x, y);
-                });
-                if (!fillOK) {
-                    break;
-                }
-                _fills.push_back({ col, row });
-            }
-        }
-        if (!fillOK) {
-            break;
-        }
-    }
-
-    if (fillOK) {
-        _lines.clear();
-        canvas.swap(workArea);
+    if (fillBackground(canvas, _runs, mask, c, bg, _fills)) {
+        setFlag(areaNoLines);
         return;
     }
 
-    _fills.clear();
-
-    for (const auto& line : _lines) {
+    for (const auto& line : lines()) {
         const auto points = line.points();
 
         Point p0 = points.front();
@@ -283,29 +379,144 @@ void PixelArea::findFills(PaletteImage& canvas, uint8_t bg) {
         }
     }
 
-    workArea.copyFrom(canvas);
+    fillBackground(canvas, _runs, mask, c, bg, _fills);
+}
+
+namespace {
+
+// Areas larger than this are cheaper to outline and fill
+constexpr int maxPatternCoverPixels = 400;
+constexpr size_t maxPatternCoverStamps = 16;
+
+std::vector<uint8_t> patternCandidates() {
+    // Largest stamps first, ending with the single pixel circle which fits anywhere
+    std::vector<uint8_t> candidates;
+    for (int size = maxPatternSize; size >= 0; size--) {
+        candidates.push_back(size | patternFlagRectangle);
+        candidates.push_back(size);
+    }
+    return candidates;
+}
+
+}  // namespace
+
+bool PixelArea::coverWithPatterns(int width, int height) {
+    _patterns.clear();
+
+    if (_runs.empty()) {
+        return false;
+    }
+
+    int minX = width;
+    int maxX = -1;
+    int minY = height;
+    int maxY = -1;
+    int uncovered = 0;
 
     for (const auto& run : _runs) {
-        int row = run.row;
-        for (int col = run.start; col < run.start + run.length; col++) {
-            if (workArea.get(col, row) == bg) {
-                fillOK = workArea.fillWhere(col, row, c, bg, [this](int x, int y) {
-                    return contains(x, y);
-                });
-                if (fillOK) {
-                    _fills.push_back({ col, row });
-                } else {
-                    _fills.clear();
-                    return;
+        minX = std::min<int>(minX, run.start);
+        maxX = std::max(maxX, run.start + run.length - 1);
+        minY = std::min<int>(minY, run.row);
+        maxY = std::max<int>(maxY, run.row);
+        uncovered += run.length;
+    }
+
+    if (uncovered > maxPatternCoverPixels) {
+        return false;
+    }
+
+    const int w = maxX - minX + 1;
+    const int h = maxY - minY + 1;
+
+    // 0: outside area, 1: uncovered area pixel, 2: covered area pixel
+    std::vector<uint8_t> mask(w * h, 0);
+    for (const auto& run : _runs) {
+        const auto offset = (run.row - minY) * w + run.start - minX;
+        std::fill(mask.begin() + offset, mask.begin() + offset + run.length, 1);
+    }
+
+    const auto maskAt = [&](int x, int y) -> uint8_t {
+        if (x < minX || x > maxX || y < minY || y > maxY) {
+            return 0;
+        }
+        return mask[(y - minY) * w + x - minX];
+    };
+
+    for (const auto flags : patternCandidates()) {
+        const int size = patternSize(flags);
+        const bool rectangle = (flags & patternFlagRectangle) != 0;
+
+        std::vector<std::pair<int, int>> offsets;
+        for (int dy = -size; dy <= size; dy++) {
+            for (int dx = -size; dx <= size + 1; dx++) {
+                if (patternCovers(flags, dx, dy)) {
+                    offsets.emplace_back(dx, dy);
+                }
+            }
+        }
+
+        // Stay clear of the interpreter position clamping
+        const int firstX = std::max(minX, size);
+        const int lastX = std::min(maxX, width - 1 - size - (rectangle ? 1 : 0));
+        const int firstY = std::max(minY, size);
+        const int lastY = std::min(maxY, height - 1 - size);
+
+        for (int y = firstY; uncovered > 0 && y <= lastY; y++) {
+            for (int x = firstX; uncovered > 0 && x <= lastX; x++) {
+                bool fits = true;
+                bool coversNew = false;
+
+                for (const auto& [dx, dy] : offsets) {
+                    const auto m = maskAt(x + dx, y + dy);
+                    if (m == 0) {
+                        fits = false;
+                        break;
+                    }
+                    coversNew = coversNew || m == 1;
+                }
+
+                if (!fits || !coversNew) {
+                    continue;
+                }
+
+                if (_patterns.size() == maxPatternCoverStamps) {
+                    _patterns.clear();
+                    return false;
+                }
+
+                _patterns.push_back({ flags, Point(x, y) });
+
+                for (const auto& [dx, dy] : offsets) {
+                    auto& m = mask[(y + dy - minY) * w + x + dx - minX];
+                    if (m == 1) {
+                        m = 2;
+                        uncovered--;
+                    }
                 }
             }
         }
     }
 
-    workArea.swap(canvas);
+    if (uncovered > 0) {
+        _patterns.clear();
+        return false;
+    }
+
+    return true;
+}
+
+template <typename Canvas>
+void PixelArea::usePatterns(Canvas& canvas) {
+    setFlag(areaNoLines);
+    _fills.clear();
+
+    for (const auto& stamp : _patterns) {
+        canvas.pattern(stamp.position.x, stamp.position.y, stamp.flags, color());
+    }
 }
 
-int SCIPicVectorizer::pickColor(int x, int y, int leftColor, std::span<const uint8_t> previousRow) const {
+template <typename Size>
+int BasicSCIPicVectorizer<Size>::pickColor(int x, int y, int leftColor, std::span<const uint8_t> previousRow) const {
     const auto colorAt = [this](int x, int y, int dx, int dy) {
         assert(abs(dx) == 1 || abs(dy) == 1);
         assert(x + dx >= 0);
@@ -405,7 +616,78 @@ int SCIPicVectorizer::pickColor(int x, int y, int leftColor, std::span<const uin
     return maxColor;
 }
 
-void SCIPicVectorizer::createPaletteImage() {
+template <typename Size>
+uint64_t BasicSCIPicVectorizer<Size>::sourceKey(const SourceImage& bmp) {
+    Hash hash;
+    hash.add(stageVersion).add(bmp.width()).add(bmp.height());
+    for (int y = 0; y < bmp.height(); y++) {
+        hash.add(bmp.packedRow(y));
+    }
+    return hash.value();
+}
+
+template <typename Size>
+Palette BasicSCIPicVectorizer<Size>::stagedPalette(const SourceImage& bmp, const StageStore* stages, uint64_t key) {
+    std::optional<Palette> palette;
+    memoizeStage(
+        stages,
+        "palette",
+        key,
+        [&](StageReader& reader) {
+            palette = readPalette(reader);
+        },
+        [&]() {
+            palette = buildPalette(bmp);
+        },
+        [&](StageWriter& writer) {
+            writeStage(writer, *palette);
+        });
+    return std::move(*palette);
+}
+
+template <typename Size>
+void BasicSCIPicVectorizer<Size>::writeAreas(StageWriter& writer) const {
+    writer.u32(uint32_t(_areas.size()));
+    for (const auto& area : _areas) {
+        writer.u16(uint16_t(area.top()));
+        writer.u8(area.color());
+        writer.u32(uint32_t(area.runs().size()));
+        for (const auto& run : area.runs()) {
+            writer.u16(uint16_t(run.row));
+            writer.u16(uint16_t(run.start));
+            writer.u16(uint16_t(run.length));
+        }
+    }
+}
+
+template <typename Size>
+void BasicSCIPicVectorizer<Size>::readAreas(StageReader& reader) {
+    const int width = _source.width();
+    const int height = _source.height();
+
+    std::vector<PixelRun> runs;
+    for (auto count = reader.u32(); count > 0; count--) {
+        const int top = reader.u16();
+        const auto color = reader.u8();
+        runs.clear();
+        for (auto runCount = reader.u32(); runCount > 0; runCount--) {
+            const int row = reader.u16();
+            const int start = reader.u16();
+            const int length = reader.u16();
+            if (row >= height || length == 0 || start + length > width) {
+                throw std::runtime_error("Bad stage area run");
+            }
+            runs.emplace_back(row, start, length, color);
+        }
+        if (runs.empty() || color >= _colors.size()) {
+            throw std::runtime_error("Bad stage area");
+        }
+        _areas.emplace_back(top, color, runs);
+    }
+}
+
+template <typename Size>
+void BasicSCIPicVectorizer<Size>::createPaletteImage() {
     int previousColor = -1;
     std::span<const uint8_t> previousRow({});
 
@@ -419,184 +701,631 @@ void SCIPicVectorizer::createPaletteImage() {
     }
 }
 
-void SCIPicVectorizer::scanRow(int y, std::vector<PixelAreaID>& columnAreas) {
-    int startColumn = 0;
-    auto currentColor = _paletteImage.get(startColumn, y);
-
-    PixelArea startArea(y, startColumn, currentColor);
-    PixelAreaID currentArea = startArea.id();
-
-    if (y > 0 && currentColor == _paletteImage.get(startColumn, y - 1)) {
-        const auto matchingID = columnAreas[startColumn];
-        auto& matchingArea = _areaMap[matchingID];
-        assert(!matchingArea.empty());
-        matchingArea.merge(startArea);
-        currentArea = matchingArea.id();
-    } else {
-        _areaMap.insert({ currentArea, startArea });
-        columnAreas[startColumn] = startArea.id();
-    }
-
-    for (int x = 1; x < _paletteImage.width(); x++) {
-        auto color = _paletteImage.get(x, y);
-        if (color == currentColor) {
-            if (y > 0 && color == _paletteImage.get(x, y - 1)) {
-                const auto matchingID = columnAreas[x];
-                auto& matchingArea = _areaMap[matchingID];
-                assert(!matchingArea.empty());
-                if (matchingArea.id() != currentArea) {
-                    matchingArea.merge(_areaMap[currentArea]);
-                    for (auto& ca : columnAreas) {
-                        if (ca == currentArea) {
-                            ca = matchingArea.id();
-                        }
-                    }
-                    _areaMap.erase(currentArea);
-                    currentArea = matchingArea.id();
-                }
-            }
-            columnAreas[x] = currentArea;
-            continue;
-        }
-        _areaMap[currentArea].extendLastRunTo(x - 1);
-
-        currentColor = color;
-        startColumn = x;
-
-        PixelArea newArea(y, startColumn, currentColor);
+template <typename Size>
+bool BasicSCIPicVectorizer<Size>::continueFrom(const ScanState& state) {
+    if (state.empty() || state.source->width() != _source.width() || state.source->height() != _source.height()) {
+        return false;
+    }
 
-        if (y > 0 && color == _paletteImage.get(x, y - 1)) {
-            const auto matchingID = columnAreas[x];
-            auto& matchingArea = _areaMap[matchingID];
-            assert(!matchingArea.empty());
-            matchingArea.merge(newArea);
-            currentArea = matchingArea.id();
-        } else {
-            currentArea = newArea.id();
-            _areaMap.insert({ currentArea, newArea });
-            columnAreas[startColumn] = currentArea;
+    // Palettes are ordered by use, so most edits reorder them, which changes every area.
+    // An edit that brings no new colors keeps the palette of the state instead.
+    for (const auto& color : _colors.colors()) {
+        if (std::ranges::find(state.colors, color) == state.colors.end()) {
+            return false;
         }
     }
-    _areaMap[currentArea].extendLastRunTo(_source.width() - 1);
+    _colors = Palette(state.colors);
+    return true;
 }
 
-void encodeAreaLines(const PixelArea& area, std::vector<SCICommand>& sink) {
-    for (const auto& line : area.lines()) {
-        encodeMultiLine(line.points(), sink);
-    }
-}
+template <typename Size>
+void BasicSCIPicVectorizer<Size>::updatePaletteImage(const ScanState& previous) {
+    const int height = _source.height();
+    const auto& before = *previous.source;
 
-void encodeAreaPixels(const PixelArea& area, std::vector<SCICommand>& sink) {
-    if (!area.pixels().empty()) {
-        encodePatterns(area.pixels(), sink);
+    int firstChanged = 0;
+    while (firstChanged < height && std::ranges::equal(_source.packedRow(firstChanged), before.packedRow(firstChanged))) {
+        firstChanged++;
     }
-}
-
-void encodeAreaFills(const PixelArea& area, std::vector<SCICommand>& sink) {
-    for (const auto& fill : area.fills()) {
-        sink.push_back(encodeFill(fill.x, fill.y));
+    int lastChanged = height - 1;
+    while (lastChanged > firstChanged && std::ranges::equal(_source.packedRow(lastChanged), before.packedRow(lastChanged))) {
+        lastChanged--;
     }
-}
 
-void encodeAreas(const std::list<PixelArea>& areas, std::vector<SCICommand>& sink) {
-    if (areas.empty()) {
+    _paletteImage.copyFrom(*previous.paletteImage);
+    if (firstChanged == height) {
         return;
     }
 
-    auto currentColor = areas.front().color();
-    sink.push_back(encodeVisual(currentColor));
+    // Colors are picked from source pixels up to three rows away, and from the pixels
+    // already picked above and to the left
+    constexpr int reach = 3;
+    const int top = std::max(firstChanged - reach, 0);
+    int previousColor = top > 0 ? _paletteImage.get(_source.width() - 1, top - 1) : -1;
+    std::span<const uint8_t> previousRow = top > 0 ? _paletteImage.row(top - 1) : std::span<const uint8_t>();
 
-    for (const auto& area : areas) {
-        if (area.color() != currentColor) {
-            currentColor = area.color();
-            sink.push_back(encodeVisual(currentColor));
+    for (int y = top; y < height; y++) {
+        bool same = true;
+        for (int x = 0; x < _source.width(); x++) {
+            const auto c = pickColor(x, y, previousColor, previousRow);
+            same = same && c == previous.paletteImage->get(x, y);
+            _paletteImage.put(x, y, c);
+            previousColor = c;
+        }
+        previousRow = _paletteImage.row(y);
+
+        // Below the changes, a row picked as before is followed by the rows picked before
+        if (same && y >= lastChanged + reach) {
+            break;
         }
-        encodeAreaPixels(area, sink);
-        encodeAreaLines(area, sink);
-        encodeAreaFills(area, sink);
     }
 }
 
-bool singlePixelRunMatchesArea(const PixelRun& run, const PixelArea& area, const Palette& p) {
-    assert(run.length == 1);
-    const auto& runColor = p.get(run.color);
-    const auto& areaColor = p.get(area.color());
-    return effectiveColor(runColor, run.start, run.row) == effectiveColor(areaColor, run.start, run.row);
+template <typename Size>
+RunImage::RunImage(const BasicByteImage<Size>& image)
+    : _width(image.width()), _height(image.height()), _words((image.width() + 63) / 64), _above(_words * image.height()) {
+    std::vector<uint64_t> starts(_words);
+
+    for (int y = 0; y < _height; y++) {
+        const auto row = image.row(y);
+        _rowStarts.push_back(_runs.size());
+
+        markRunStarts(row, starts);
+        int start = -1;
+        for (int word = 0; word < _words; word++) {
+            for (auto bits = starts[word]; bits != 0; bits &= bits - 1) {
+                const int x = word * 64 + std::countr_zero(bits);
+                if (start >= 0) {
+                    _runs.emplace_back(y, start, x - start, row[start]);
+                }
+                start = x;
+            }
+        }
+        _runs.emplace_back(y, start, _width - start, row[start]);
+
+        if (y > 0) {
+            markEqualBytes(row, image.row(y - 1), std::span(_above).subspan(y * _words, _words));
+        }
+    }
+    _rowStarts.push_back(_runs.size());
 }
 
-void SCIPicVectorizer::scan() {
-    _areaMap.clear();
-    _sortedAreas.clear();
-    createPaletteImage();
+template <typename Size>
+void BasicSCIPicVectorizer<Size>::scanRow(const RunImage& runs, int y, int top, std::vector<size_t>& columnAreas, Areas& areas)
+    const {
+    // Areas merged into others are left empty, and dropped after labeling
+    const bool connected = y > top;
+
+    for (const auto& run : runs.row(y)) {
+        const int end = run.start + run.length;
+        PixelArea newArea(run, areas.get_allocator());
+        size_t currentArea = 0;
+
+        if (connected && runs.sameAsAbove(run.start, y)) {
+            currentArea = columnAreas[run.start];
+            assert(!areas[currentArea].empty());
+            areas[currentArea].merge(newArea);
+        } else {
+            currentArea = areas.size();
+            areas.push_back(std::move(newArea));
+        }
 
-    std::vector<PixelAreaID> rowMemory(_source.width(), { -1, -1 });
+        if (connected) {
+            runs.forEachSameAsAbove(y, run.start + 1, end, [&](int x) {
+                const auto matchingArea = columnAreas[x];
+                assert(!areas[matchingArea].empty());
+                if (matchingArea != currentArea) {
+                    areas[matchingArea].merge(areas[currentArea]);
+                    std::ranges::replace(columnAreas, currentArea, matchingArea);
+                    currentArea = matchingArea;
+                }
+            });
+        }
 
-    for (int y = 0; y < _source.height(); y++) {
-        scanRow(y, rowMemory);
+        std::fill(columnAreas.begin() + run.start, columnAreas.begin() + end, currentArea);
+    }
+}
+
+template <typename Size>
+void BasicSCIPicVectorizer<Size>::labelAreas() {
+    const int width = _source.width();
+    const int height = _source.height();
+    const int bands = std::clamp(_options.tiles, 1, height);
+
+    const auto bandTop = [&](int band) {
+        return band * height / bands;
+    };
+
+    std::vector<Areas> bandAreas;
+    for (int band = 0; band < bands; band++) {
+        bandAreas.emplace_back(&_arena);
+    }
+
+    const RunImage runs(_paletteImage);
+
+    parallelFor(bands, [&](size_t band) {
+        std::vector<size_t> columnAreas(width, 0);
+        for (int y = bandTop(band); y < bandTop(band + 1); y++) {
+            scanRow(runs, y, bandTop(band), columnAreas, bandAreas[band]);
+        }
+    });
+
+    // Stitch areas that continue across band seams, using union-find over all band areas
+    std::vector<PixelArea*> nodes;
+    std::vector<size_t> firstNode;
+    for (auto& areas : bandAreas) {
+        firstNode.push_back(nodes.size());
+        for (auto& area : areas) {
+            if (!area.empty()) {
+                nodes.push_back(&area);
+            }
+        }
+    }
+    firstNode.push_back(nodes.size());
+
+    std::vector<size_t> parents(nodes.size());
+    std::iota(parents.begin(), parents.end(), 0);
+
+    const auto root = [&parents](size_t node) {
+        while (parents[node] != node) {
+            parents[node] = parents[parents[node]];
+            node = parents[node];
+        }
+        return node;
+    };
+
+    const auto rowNodes = [&](int band, int y) {
+        std::vector<size_t> row(width);
+        for (auto node = firstNode[band]; node < firstNode[band + 1]; node++) {
+            for (const auto& run : nodes[node]->runs()) {
+                if (run.row == y) {
+                    std::fill_n(row.begin() + run.start, run.length, node);
+                }
+            }
+        }
+        return row;
+    };
+
+    for (int band = 1; band < bands; band++) {
+        const int seam = bandTop(band);
+        const auto above = rowNodes(band - 1, seam - 1);
+        const auto below = rowNodes(band, seam);
+
+        for (int x = 0; x < width; x++) {
+            if (runs.sameAsAbove(x, seam)) {
+                const auto a = root(above[x]);
+                const auto b = root(below[x]);
+                if (a != b) {
+                    parents[std::max(a, b)] = std::min(a, b);
+                }
+            }
+        }
+    }
+
+    for (size_t node = 0; node < nodes.size(); node++) {
+        const auto r = root(node);
+        if (r != node) {
+            nodes[r]->merge(*nodes[node]);
+        }
+    }
+
+    for (size_t node = 0; node < nodes.size(); node++) {
+        if (root(node) == node) {
+            _areas.push_back(std::move(*nodes[node]));
+        }
+    }
+
+    // Top left order, independent of the banding
+    std::ranges::sort(_areas, [](const PixelArea& a, const PixelArea& b) {
+        return a.id() < b.id();
+    });
+}
+
+void encodeAreaLines(const PixelArea& area, std::vector<SCICommand>& sink) {
+    for (const auto& line : area.lines()) {
+        encodeMultiLine(line.points(), sink);
+    }
+}
+
+void encodeAreaPixels(const PixelArea& area, std::vector<SCICommand>& sink) {
+    if (!area.pixels().empty()) {
+        encodePatterns(area.pixels(), sink);
+    }
+}
+
+void encodeAreaFills(const PixelArea& area, std::vector<SCICommand>& sink) {
+    for (const auto& fill : area.fills()) {
+        sink.push_back(encodeFill(fill.x, fill.y));
+    }
+}
+
+void encodeAreaPatterns(const PixelArea& area, uint8_t& currentPattern, std::vector<SCICommand>& sink) {
+    const auto patterns = area.patterns();
+    std::vector<Point> positions;
+
+    for (auto stamp = patterns.begin(); stamp != patterns.end();) {
+        const auto flags = stamp->flags;
+        positions.clear();
+        for (; stamp != patterns.end() && stamp->flags == flags; stamp++) {
+            positions.push_back(stamp->position);
+        }
+        if (flags != currentPattern) {
+            sink.push_back(encodePattern(flags));
+            currentPattern = flags;
+        }
+        encodePatterns(positions, sink);
+    }
+}
+
+void encodeAreas(std::span<const PixelArea> areas, std::span<const size_t> order, std::vector<SCICommand>& sink) {
+    if (order.empty()) {
+        return;
+    }
+
+    auto currentColor = areas[order.front()].color();
+    sink.push_back(encodeVisual(currentColor));
+
+    // The single pixel pattern is set up before the areas are encoded
+    uint8_t currentPattern = 0;
+
+    for (const auto index : order) {
+        const auto& area = areas[index];
+        if (area.color() != currentColor) {
+            currentColor = area.color();
+            sink.push_back(encodeVisual(currentColor));
+        }
+        if (!area.pixels().empty() && currentPattern != 0) {
+            sink.push_back(encodeSolidCirclePattern(0));
+            currentPattern = 0;
+        }
+        encodeAreaPixels(area, sink);
+        encodeAreaPatterns(area, currentPattern, sink);
+        encodeAreaLines(area, sink);
+        encodeAreaFills(area, sink);
+    }
+}
+
+size_t linesAndFillsSize(const PixelArea& area) {
+    std::vector<SCICommand> commands;
+    encodeAreaLines(area, commands);
+    encodeAreaFills(area, commands);
+    return encodedSize(commands);
+}
+
+size_t patternsSize(const PixelArea& area) {
+    std::vector<SCICommand> commands;
+    uint8_t currentPattern = 0;
+    encodeAreaPatterns(area, currentPattern, commands);
+    if (currentPattern != 0) {
+        // Restoring the single pixel pattern for later areas
+        commands.push_back(encodeSolidCirclePattern(0));
     }
+    return encodedSize(commands);
+}
+
+size_t encodedAreasSize(std::span<const PixelArea> areas, std::span<const size_t> order) {
+    std::vector<SCICommand> commands;
+    encodeAreas(areas, order, commands);
+    optimizeCommands(commands);
+    return encodedSize(commands);
+}
 
-    for (auto& kv : _areaMap) {
-        assert(!kv.second.empty());
-        _sortedAreas.push_back(kv.second);
+template <typename Size>
+void BasicSCIPicVectorizer<Size>::orderAreas(DrawOrder& order) const {
+    // An area fills without outlines when all its neighbours are drawn before it.
+    // Picking the areas to put last is a weighted independent set problem on the
+    // area adjacency graph, weighted by the outline bytes saved.
+
+    const int width = _source.width();
+    const int height = _source.height();
+
+    std::vector<const PixelArea*> nodes;
+    std::vector<int> labels(width * height, -1);
+
+    for (const auto index : order) {
+        const auto& area = _areas[index];
+        for (const auto& run : area.runs()) {
+            std::fill_n(labels.begin() + run.row * width + run.start, run.length, nodes.size());
+        }
+        nodes.push_back(&area);
     }
 
-    std::set<PixelAreaID> erasedAreas;
+    std::vector<std::set<int>> neighbours(nodes.size());
 
-    for (auto a = _sortedAreas.begin(); a != _sortedAreas.end(); a++) {
-        if (a->singular()) {
-            auto& run = a->runs().front();
-            auto* left = areaAt(run.start - 1, run.row);
-            if (left != nullptr && singlePixelRunMatchesArea(run, *left, _colors)) {
-                erasedAreas.insert(a->id());
-                PixelArea pixel(run.row, run.start, left->color());
-                left->merge(pixel);
+    for (int y = 0; y < height; y++) {
+        for (int x = 0; x < width; x++) {
+            const auto label = labels[y * width + x];
+            const auto right = x + 1 < width ? labels[y * width + x + 1] : label;
+            const auto below = y + 1 < height ? labels[(y + 1) * width + x] : label;
+            if (label == -1) {
                 continue;
             }
-            auto* right = areaAt(run.start + 1, run.row);
-            if (right != nullptr && singlePixelRunMatchesArea(run, *right, _colors)) {
-                erasedAreas.insert(a->id());
-                PixelArea pixel(run.row, run.start, right->color());
-                right->merge(pixel);
+            if (right != label && right != -1) {
+                neighbours[label].insert(right);
+                neighbours[right].insert(label);
+            }
+            if (below != label && below != -1) {
+                neighbours[label].insert(below);
+                neighbours[below].insert(label);
+            }
+        }
+    }
+
+    const auto containsWhite = [this](const PixelArea& area) {
+        const auto& color = _colors.get(area.color());
+        return color.first == 0xf || color.second == 0xf;
+    };
+
+    // Areas next to white pixels will always need outlines
+    std::vector<int> weights(nodes.size(), 0);
+    for (size_t i = 0; i < nodes.size(); i++) {
+        if (!nodes[i]->hasFlag(areaFilled)) {
+            continue;
+        }
+        if (std::ranges::any_of(neighbours[i], [&](int n) { return containsWhite(*nodes[n]); })) {
+            continue;
+        }
+        std::vector<SCICommand> commands;
+        encodeAreaLines(*nodes[i], commands);
+        weights[i] = encodedSize(commands);
+    }
+
+    std::vector<int> candidates;
+    for (size_t i = 0; i < nodes.size(); i++) {
+        if (weights[i] > 0) {
+            candidates.push_back(i);
+        }
+    }
+
+    std::ranges::stable_sort(candidates, [&](int a, int b) {
+        return weights[a] * (neighbours[b].size() + 1) > weights[b] * (neighbours[a].size() + 1);
+    });
+
+    std::vector<bool> last(nodes.size(), false);
+
+    const auto isFree = [&](int node) {
+        return std::ranges::none_of(neighbours[node], [&](int n) { return last[n]; });
+    };
+
+    for (const auto c : candidates) {
+        if (isFree(c)) {
+            last[c] = true;
+        }
+    }
+
+    // Local search, swapping in areas that outweigh their conflicting neighbours
+    int moves = 0;
+    for (bool improved = true; improved && moves < _options.orderBudget;) {
+        improved = false;
+        for (const auto c : candidates) {
+            if (last[c]) {
                 continue;
             }
-            auto* top = areaAt(run.start, run.row - 1);
-            if (top != nullptr && singlePixelRunMatchesArea(run, *top, _colors)) {
-                erasedAreas.insert(a->id());
-                PixelArea pixel(run.row, run.start, top->color());
-                top->merge(pixel);
+            int conflicting = 0;
+            for (const auto n : neighbours[c]) {
+                conflicting += last[n] ? weights[n] : 0;
+            }
+            if (weights[c] <= conflicting) {
                 continue;
             }
-            auto* bottom = areaAt(run.start, run.row + 1);
-            if (bottom != nullptr && singlePixelRunMatchesArea(run, *bottom, _colors)) {
-                erasedAreas.insert(a->id());
-                PixelArea pixel(run.row, run.start, bottom->color());
-                bottom->merge(pixel);
+
+            std::vector<int> released;
+            for (const auto n : neighbours[c]) {
+                if (last[n]) {
+                    last[n] = false;
+                    released.push_back(n);
+                }
+            }
+            last[c] = true;
+
+            for (const auto r : released) {
+                for (const auto n : neighbours[r]) {
+                    if (weights[n] > 0 && !last[n] && isFree(n)) {
+                        last[n] = true;
+                    }
+                }
+            }
+
+            improved = true;
+            if (++moves >= _options.orderBudget) {
+                break;
+            }
+        }
+    }
+
+    DrawOrder reordered;
+    for (const bool drawLast : { false, true }) {
+        for (size_t node = 0; node < nodes.size(); node++) {
+            if (last[node] == drawLast) {
+                reordered.push_back(order[node]);
+            }
+        }
+    }
+    order.swap(reordered);
+}
+
+template <typename Size>
+template <typename Target>
+void BasicSCIPicVectorizer<Size>::placeArea(PixelArea& area, Target& canvas, bool fill) {
+    if (area.patterns().empty()) {
+        if (fill) {
+            area.findFills(canvas, 0xf);
+        }
+        return;
+    }
+
+    // Fills are drawn on trial, and taken back if patterns turn out smaller
+    const auto trial = canvas.mark();
+    if (fill) {
+        area.findFills(canvas, 0xf);
+    }
+
+    if (patternsSize(area) < linesAndFillsSize(area)) {
+        canvas.undo(trial);
+        area.usePatterns(canvas);
+    } else {
+        area.clearPatterns();
+    }
+}
+
+bool rendersAs(const PixelArea& area, uint8_t colorIndex, const Palette& p) {
+    const auto& areaColor = p.get(area.color());
+    const auto& color = p.get(colorIndex);
+    for (const auto& run : area.runs()) {
+        for (int x = run.start; x < run.start + run.length; x++) {
+            if (effectiveColor(areaColor, x, run.row) != effectiveColor(color, x, run.row)) {
+                return false;
+            }
+        }
+    }
+    return true;
+}
+
+template <typename Size>
+void BasicSCIPicVectorizer<Size>::mergeEquivalentAreas() {
+    // Areas that render identically under the palette entry of a neighbour,
+    // typically dither slivers, are absorbed by that neighbour.
+
+    const int width = _source.width();
+    const int height = _source.height();
+
+    std::vector<PixelArea*> labels(width * height, nullptr);
+    for (auto& area : _areas) {
+        for (const auto& run : area.runs()) {
+            std::fill_n(labels.begin() + run.row * width + run.start, run.length, &area);
+        }
+    }
+
+    for (auto& area : _areas) {
+        std::vector<PixelArea*> neighbours;
+
+        const auto addNeighbour = [&](int x, int y) {
+            if (x < 0 || x >= width || y < 0 || y >= height) {
+                return;
+            }
+            auto* neighbour = labels[y * width + x];
+            if (neighbour != &area && std::ranges::find(neighbours, neighbour) == neighbours.end()) {
+                neighbours.push_back(neighbour);
+            }
+        };
+
+        for (const auto& run : area.runs()) {
+            for (int x = run.start; x < run.start + run.length; x++) {
+                addNeighbour(x - 1, run.row);
+                addNeighbour(x + 1, run.row);
+                addNeighbour(x, run.row - 1);
+                addNeighbour(x, run.row + 1);
+            }
+        }
+
+        for (auto* neighbour : neighbours) {
+            if (!rendersAs(area, neighbour->color(), _colors)) {
                 continue;
             }
+            for (const auto& run : area.runs()) {
+                std::fill_n(labels.begin() + run.row * width + run.start, run.length, neighbour);
+                for (int x = run.start; x < run.start + run.length; x++) {
+                    _paletteImage.put(x, run.row, neighbour->color());
+                }
+            }
+            area.recolor(neighbour->color());
+            neighbour->merge(area);
+            break;
         }
     }
 
-    std::set<PixelAreaID> singlePixelAreas;
-    for (auto it = _sortedAreas.begin(); it != _sortedAreas.end();) {
-        if (erasedAreas.contains(it->id())) {
-            it = _sortedAreas.erase(it);
+    std::erase_if(_areas, [](const PixelArea& area) {
+        return area.empty();
+    });
+}
+
+namespace {
+
+// Tracing sorts the runs of an area, so areas are compared by their runs in row order
+std::vector<PixelRun> orderedRuns(const PixelArea& area) {
+    std::vector<PixelRun> runs(area.runs().begin(), area.runs().end());
+    std::ranges::sort(runs, [](const PixelRun& a, const PixelRun& b) {
+        return std::pair(a.row, a.start) < std::pair(b.row, b.start);
+    });
+    return runs;
+}
+
+}  // namespace
+
+template <typename Size>
+bool BasicSCIPicVectorizer<Size>::scan(ScanState* state) {
+    _areas.clear();
+    _order.clear();
+
+    const ScanState* previous = state != nullptr && continueFrom(*state) ? state : nullptr;
+    std::optional<BasicByteImage<Size>> labeledImage;
+
+    // The areas only depend on the source and the tiling, so other options can be
+    // tried without labeling again
+    const auto paletteImageKey = Hash().add(_sourceKey).add(std::string_view("palette-image")).value();
+    const auto areasKey = Hash().add(paletteImageKey).add(_options.tiles).value();
+    const auto makeAreas = [&]() {
+        _areas.clear();
+        if (previous != nullptr) {
+            updatePaletteImage(*previous);
         } else {
-            if (it->singular()) {
-                singlePixelAreas.insert(it->id());
-            }
-            ++it;
+            memoizeStage(
+                _stages,
+                "palette-image",
+                paletteImageKey,
+                [this](StageReader& reader) {
+                    readStage(reader, _paletteImage);
+                },
+                [this]() {
+                    createPaletteImage();
+                },
+                [this](StageWriter& writer) {
+                    writeStage(writer, _paletteImage);
+                });
+        }
+        if (state != nullptr) {
+            labeledImage.emplace(_paletteImage);
+        }
+        labelAreas();
+        mergeEquivalentAreas();
+    };
+
+    // Keeping a state takes the palette image, which stored areas come without
+    if (state != nullptr) {
+        makeAreas();
+    } else {
+        memoizeStage(
+            _stages,
+            "areas",
+            areasKey,
+            [this](StageReader& reader) {
+                readAreas(reader);
+            },
+            makeAreas,
+            [this](StageWriter& writer) {
+                writeAreas(writer);
+            });
+    }
+
+    for (auto& area : _areas) {
+        if (area.singular()) {
+            area.setFlag(areaSinglePixel);
         }
     }
 
-    _sortedAreas.sort([](const auto& a, const auto& b) {
-        return a.color() <= b.color();
+    _order.resize(_areas.size());
+    std::iota(_order.begin(), _order.end(), 0);
+    std::ranges::stable_sort(_order, [this](size_t a, size_t b) {
+        return _areas[a].color() < _areas[b].color();
     });
 
-    std::set<PixelAreaID> areasToFill;
+    // First pass, lines only. Areas are traced independently from the palette image.
+    std::vector<PixelArea*> lineAreas;
+    std::vector<PixelArea*> tracedAreas;
 
-    // First pass, lines only
-    for (auto& area : _sortedAreas) {
-        if (erasedAreas.contains(area.id()) || singlePixelAreas.contains(area.id())) {
+    for (const auto index : _order) {
+        auto& area = _areas[index];
+        if (area.hasFlag(areaSinglePixel)) {
             continue;
         }
         const auto& color = _colors.get(area.color());
@@ -604,86 +1333,440 @@ void SCIPicVectorizer::scan() {
             continue;
         }
         if (color.first == 0xf || color.second == 0xf) {
+            lineAreas.push_back(&area);
+        } else {
+            tracedAreas.push_back(&area);
+        }
+    }
+
+    // Tracing only depends on the runs of an area, so unchanged areas are taken as traced before
+    // Areas are keyed by their top left run, which no two areas share
+    std::map<PixelAreaID, std::pair<std::vector<PixelRun>, const PixelArea*>> previousAreas;
+    if (previous != nullptr) {
+        for (const auto& area : previous->areas) {
+            auto runs = orderedRuns(area);
+            const PixelAreaID top{ runs.front().row, runs.front().start };
+            previousAreas.emplace(top, std::pair(std::move(runs), &area));
+        }
+    }
+    const auto reuseTraced = [&previousAreas](PixelArea& area) {
+        if (previousAreas.empty()) {
+            return false;
+        }
+        const auto runs = orderedRuns(area);
+        const auto match = previousAreas.find({ runs.front().row, runs.front().start });
+        if (match == previousAreas.end()) {
+            return false;
+        }
+        const auto& [previousRuns, previousArea] = match->second;
+        if (previousArea->color() != area.color() || previousRuns != runs) {
+            return false;
+        }
+        area = PixelArea(*previousArea, area.get_allocator());
+        return true;
+    };
+
+    parallelFor(lineAreas.size() + tracedAreas.size(), [&](size_t i) {
+        auto& area = i < lineAreas.size() ? *lineAreas[i] : *tracedAreas[i - lineAreas.size()];
+        if (reuseTraced(area)) {
+            return;
+        }
+        if (i < lineAreas.size()) {
             area.fillWithLines();
+            area.coverWithPatterns(_source.width(), _source.height());
         } else {
-            area.traceLines(_paletteImage);
+            area.traceLines(_source.width(), _source.height());
             area.optimizeLines();
-            areasToFill.insert(area.id());
+            area.coverWithPatterns(_source.width(), _source.height());
         }
+    });
+
+    for (auto* area : tracedAreas) {
+        area->setFlag(areaFilled);
     }
 
-    PaletteImage canvas(_source.width(), _source.height(), _colors);
-    canvas.clear(0xf);
+    if (state != nullptr) {
+        state->source.emplace(_source);
+        state->colors.assign(_colors.colors().begin(), _colors.colors().end());
+        state->paletteImage = std::move(labeledImage);
+        state->areas.assign(_areas.begin(), _areas.end());
+    }
+
+    auto reordered = _order;
+    if (_options.orderBudget > 0) {
+        orderAreas(reordered);
+    }
+
+    // Single pixel areas keep their relative order, so they merge the same way in both orders
+    mergeSinglePixelAreas(_order);
+    const auto merged = [this](size_t index) {
+        return _areas[index].empty();
+    };
+    std::erase_if(_order, merged);
+    std::erase_if(reordered, merged);
+
+    if (_options.orderBudget <= 0) {
+        placeAreas(_order);
+        return previous != nullptr;
+    }
+
+    // Keep the palette order if the optimized order does not pay off
+    placeAreas(reordered);
+    const auto reorderedSize = encodedAreasSize(_areas, reordered);
+
+    std::vector<PixelArea::Placement> placements;
+    for (auto& area : _areas) {
+        placements.push_back(area.placement());
+        area.resetPlacement();
+    }
+
+    placeAreas(_order);
 
-    if (!singlePixelAreas.empty()) {
-        std::list<Point> pixels;
-        auto a0 = _sortedAreas.begin();
-        while (a0 != _sortedAreas.end() && !singlePixelAreas.contains(a0->id())) {
-            a0++;
+    if (reorderedSize < encodedAreasSize(_areas, _order)) {
+        for (size_t i = 0; i < _areas.size(); i++) {
+            _areas[i].restorePlacement(placements[i]);
+        }
+        _order.swap(reordered);
+    }
+
+    return previous != nullptr;
+}
+
+namespace {
+
+using PixelWrite = std::pair<size_t, uint8_t>;
+
+// An area only reads its own pixels and their neighbours from the canvas
+bool readsDirtyPixels(const PixelArea& area, const std::vector<uint8_t>& dirty, int width, int height) {
+    for (const auto& run : area.runs()) {
+        const int left = std::max(run.start - 1, 0);
+        const int right = std::min(run.start + run.length, width - 1);
+        for (int y = std::max(run.row - 1, 0); y <= std::min(run.row + 1, height - 1); y++) {
+            for (int x = left; x <= right; x++) {
+                if (dirty[y * width + x] != 0) {
+                    return true;
+                }
+            }
         }
-        pixels.emplace_back(a0->left(), a0->top());
+    }
+    return false;
+}
+
+// Palette drawing for canvases that only write EGA pixels themselves
+template <typename Target>
+struct CanvasDrawing {
+    void put(int x, int y, uint8_t colorIndex) {
+        auto& target = static_cast<Target&>(*this);
+        target.putEGA(x, y, effectiveColor(target.palette().get(colorIndex), x, y));
+    }
+
+    void line(int x0, int y0, int x1, int y1, uint8_t colorIndex) {
+        plotLine(x0, y0, x1, y1, [&](int x, int y) {
+            put(x, y, colorIndex);
+        });
+    }
+
+    void pattern(int x, int y, uint8_t patternFlags, uint8_t colorIndex) {
+        const auto& target = static_cast<const Target&>(*this);
+        plotPattern(x, y, patternFlags, target.width(), target.height(), [&](int px, int py) {
+            put(px, py, colorIndex);
+        });
+    }
+};
+
+// Draws on a canvas, logging the pixels it replaces so drawing can be taken back to a mark
+template <typename Canvas>
+struct UndoableCanvas : CanvasDrawing<UndoableCanvas<Canvas>> {
+    explicit UndoableCanvas(Canvas& canvas) : _canvas(canvas) {
+    }
+
+    int width() const {
+        return _canvas.width();
+    }
+
+    int height() const {
+        return _canvas.height();
+    }
+
+    const Palette& palette() const {
+        return _canvas.palette();
+    }
+
+    uint8_t get(int x, int y) const {
+        return _canvas.get(x, y);
+    }
+
+    void putEGA(int x, int y, uint8_t color) {
+        _log.push_back({ uint32_t(y * width() + x), _canvas.get(x, y) });
+        _canvas.putEGA(x, y, color);
+    }
 
-        // Second pass, single-pixel areas
-        auto area = a0;
-        area++;
-        for (; area != _sortedAreas.end(); area++) {
-            if (!singlePixelAreas.contains(area->id())) {
+    size_t mark() const {
+        return _log.size();
+    }
+
+    void undo(size_t mark) {
+        while (_log.size() > mark) {
+            const auto& write = _log.back();
+            _canvas.putEGA(write.index % width(), write.index / width(), write.previous);
+            _log.pop_back();
+        }
+    }
+
+   private:
+    struct Write {
+        uint32_t index;
+        uint8_t previous;
+    };
+
+    Canvas& _canvas;
+    std::vector<Write> _log;
+};
+
+// Draws over a canvas without changing it. Writes are logged like on an undoable
+// canvas, and the pixels that changed are collected afterwards.
+template <typename Canvas>
+struct CanvasOverlay : CanvasDrawing<CanvasOverlay<Canvas>> {
+    explicit CanvasOverlay(const Canvas& base) : _base(base) {
+        auto& spare = sparePixels();
+        if (!spare.empty()) {
+            _pixels = std::move(spare.back());
+            spare.pop_back();
+        }
+        _pixels.resize(size_t(base.width()) * base.height(), unset);
+    }
+
+    ~CanvasOverlay() {
+        for (const auto& write : _log) {
+            _pixels[write.index] = unset;
+        }
+        sparePixels().push_back(std::move(_pixels));
+    }
+
+    CanvasOverlay(const CanvasOverlay&) = delete;
+    CanvasOverlay& operator=(const CanvasOverlay&) = delete;
+
+    int width() const {
+        return _base.width();
+    }
+
+    int height() const {
+        return _base.height();
+    }
+
+    const Palette& palette() const {
+        return _base.palette();
+    }
+
+    uint8_t get(int x, int y) const {
+        const auto pixel = _pixels[y * width() + x];
+        return pixel != unset ? pixel : _base.get(x, y);
+    }
+
+    void putEGA(int x, int y, uint8_t color) {
+        const auto index = uint32_t(y * width() + x);
+        _log.push_back({ index, _pixels[index] });
+        _pixels[index] = color;
+    }
+
+    size_t mark() const {
+        return _log.size();
+    }
+
+    void undo(size_t mark) {
+        while (_log.size() > mark) {
+            _pixels[_log.back().index] = _log.back().previous;
+            _log.pop_back();
+        }
+    }
+
+    // Pixels that differ from the canvas below
+    std::vector<PixelWrite> writes() const {
+        std::vector<PixelWrite> writes;
+        for (const auto& write : _log) {
+            // Only the first write of a pixel replaces the canvas below
+            if (write.previous != unset) {
                 continue;
             }
-            assert(area->singular());
-            if (area->color() != a0->color()) {
-                a0->setPixels(pixels);
-                pixels.clear();
-                pixels.emplace_back(area->left(), area->top());
-                a0 = area;
-            } else {
-                pixels.emplace_back(area->left(), area->top());
-                a0->merge(*area);
+            const auto value = _pixels[write.index];
+            if (value != _base.get(write.index % width(), write.index / width())) {
+                writes.emplace_back(write.index, value);
+            }
+        }
+        return writes;
+    }
+
+   private:
+    static constexpr uint8_t unset = 0xff;
+
+    struct Write {
+        uint32_t index;
+        uint8_t previous;
+    };
+
+    // Overlay pixels are all unset between uses, so they are kept for the next overlay
+    static std::vector<std::vector<uint8_t>>& sparePixels() {
+        static thread_local std::vector<std::vector<uint8_t>> spare;
+        return spare;
+    }
+
+    const Canvas& _base;
+    std::vector<uint8_t> _pixels;
+    std::vector<Write> _log;
+};
+
+template <typename Canvas, typename Place>
+std::vector<PixelWrite> placeOver(PixelArea& area, const Canvas& canvas, const Place& place) {
+    CanvasOverlay overlay(canvas);
+    place(area, overlay);
+    return overlay.writes();
+}
+
+template <typename Canvas>
+void applyWrites(Canvas& canvas, std::span<const PixelWrite> writes) {
+    for (const auto& [index, value] : writes) {
+        canvas.putEGA(index % canvas.width(), index / canvas.width(), value);
+    }
+}
+
+// Places areas on the canvas in windows of concurrent attempts, each drawing over the
+// canvas as it was before the window. An attempt is kept when no earlier area in its
+// window wrote a pixel it reads, otherwise the area is placed again in order. The
+// result equals serial placement.
+template <typename Canvas, typename Place>
+void placeSpeculatively(std::span<PixelArea* const> areas, Canvas& canvas, const Place& place) {
+    const int width = canvas.width();
+    const int height = canvas.height();
+    const size_t window = 4 * workerCount();
+
+    std::vector<uint8_t> dirty(width * height, 0);
+
+    for (size_t first = 0; first < areas.size(); first += window) {
+        const auto batch = areas.subspan(first, std::min(window, areas.size() - first));
+
+        std::vector<std::vector<PixelWrite>> writes(batch.size());
+
+        parallelFor(batch.size(), [&](size_t i) {
+            writes[i] = placeOver(*batch[i], canvas, place);
+        });
+
+        std::vector<size_t> touched;
+
+        for (size_t i = 0; i < batch.size(); i++) {
+            auto& area = *batch[i];
+
+            if (readsDirtyPixels(area, dirty, width, height)) {
+                area.resetPlacement();
+                writes[i] = placeOver(area, canvas, place);
+            }
+            applyWrites(canvas, writes[i]);
+
+            for (const auto& write : writes[i]) {
+                dirty[write.first] = 1;
+                touched.push_back(write.first);
             }
         }
-        if (!pixels.empty()) {
-            a0->setPixels(pixels);
+
+        for (const auto index : touched) {
+            dirty[index] = 0;
         }
     }
+}
 
-    // Third pass, fills
-    for (auto& area : _sortedAreas) {
-        if (area.empty()) {
+}  // namespace
+
+template <typename Size>
+void BasicSCIPicVectorizer<Size>::mergeSinglePixelAreas(const DrawOrder& order) {
+    // Single pixel areas of the same color are drawn together, by the first of them
+    PixelArea* first = nullptr;
+    std::list<Point> pixels;
+
+    for (const auto index : order) {
+        auto& area = _areas[index];
+        if (!area.hasFlag(areaSinglePixel)) {
             continue;
         }
-        if (singlePixelAreas.contains(area.id())) {
+        assert(area.singular());
+        const Point pixel(area.left(), area.top());
+        if (first == nullptr || area.color() != first->color()) {
+            if (first != nullptr) {
+                first->setPixels(pixels);
+                pixels.clear();
+            }
+            first = &area;
+        } else {
+            first->merge(area);
+        }
+        pixels.push_back(pixel);
+    }
+
+    if (first != nullptr) {
+        first->setPixels(pixels);
+    }
+}
+
+template <typename Size>
+void BasicSCIPicVectorizer<Size>::placeAreas(const DrawOrder& order) {
+    Canvas canvas(_source.width(), _source.height(), _colors);
+    canvas.clear(0xf);
+
+    std::vector<PixelArea*> placed;
+    for (const auto index : order) {
+        placed.push_back(&_areas[index]);
+    }
+
+    const auto place = [&](PixelArea& area, auto& target) {
+        if (area.hasFlag(areaSinglePixel)) {
             for (const auto& p : area.pixels()) {
-                canvas.put(p.x, p.y, area.color());
+                target.put(p.x, p.y, area.color());
             }
         }
-        if (areasToFill.contains(area.id())) {
-            area.findFills(canvas, 0xf);
+        if (area.hasFlag(areaFilled)) {
+            placeArea(area, target, true);
+        } else if (!area.patterns().empty()) {
+            placeArea(area, target, false);
         }
+    };
+
+    if (workerCount() <= 1) {
+        for (auto* area : placed) {
+            UndoableCanvas target(canvas);
+            place(*area, target);
+        }
+        return;
     }
+
+    placeSpeculatively(placed, canvas, place);
 }
 
-std::vector<SCICommand> SCIPicVectorizer::encode() const {
+template <typename Size>
+std::vector<SCICommand> BasicSCIPicVectorizer<Size>::encode() const {
     std::vector<SCICommand> commands;
 
     encodeColors(_colors, commands);
     commands.push_back(encodeSolidCirclePattern(0));
-    encodeAreas(_sortedAreas, commands);
-    printf("Produced %zu commands\n", commands.size());
-
-    int totalBytes = 0;
-    for (const auto& command : commands) {
-        totalBytes += command.params.size() + 1;
-    }
-    printf("Size: %d bytes\n", totalBytes);
+    encodeAreas(_areas, _order, commands);
+    optimizeCommands(commands);
 
     return commands;
 }
 
-PixelArea* SCIPicVectorizer::areaAt(int x, int y) {
-    for (auto& area : _sortedAreas) {
+template <typename Size>
+PixelArea* BasicSCIPicVectorizer<Size>::areaAt(int x, int y) {
+    for (auto& area : _areas) {
         if (area.contains(x, y)) {
             return &area;
         }
     }
     return nullptr;
 }
+
+template RunImage::RunImage(const ByteImage& image);
+template RunImage::RunImage(const DynamicByteImage& image);
+template void PixelArea::findFills(PaletteImage& canvas, uint8_t bg);
+template void PixelArea::findFills(DynamicPaletteImage& canvas, uint8_t bg);
+template void PixelArea::usePatterns(PaletteImage& canvas);
+template void PixelArea::usePatterns(DynamicPaletteImage& canvas);
+
+template struct BasicSCIPicVectorizer<PicExtent>;
+template struct BasicSCIPicVectorizer<DynamicExtent>;
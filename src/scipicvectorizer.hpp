@@ -3,31 +3,98 @@
 #include <memory>
 #include <vector>
 #include <list>
-#include <map>
-#include <set>
+#include <memory_resource>
 #include <cassert>
+#include <bit>
+#include <algorithm>
+#include <optional>
 
-#include "tigr.h"
+#include "arena.hpp"
 #include "image.hpp"
 #include "palette.hpp"
 #include "scipic.hpp"
+#include "stages.hpp"
 
 struct PixelRun {
-    PixelRun(int row, int start, int length, uint8_t color) : row(row), start(start), length(length), color(color) {
+    PixelRun(int row, int start, int length, uint8_t color)
+        : row(int16_t(row)), start(int16_t(start)), length(int16_t(length)), color(color) {
     }
 
-    void extendTo(int column) {
-        assert(column >= start);
-        length = column - start + 1;
-    }
+    bool operator==(const PixelRun& other) const = default;
 
-    int row;
-    int start;
-    int length;
+    int16_t row;
+    int16_t start;
+    int16_t length;
     uint8_t color;
 };
 
+// Palette image as rows of same color runs, with a bitmask per row marking the pixels
+// equal to the pixel above
+struct RunImage {
+    template <typename Size>
+    RunImage(const BasicByteImage<Size>& image);
+
+    int width() const {
+        return _width;
+    }
+
+    int height() const {
+        return _height;
+    }
+
+    std::span<const PixelRun> row(int y) const {
+        return std::span(_runs).subspan(_rowStarts[y], _rowStarts[y + 1] - _rowStarts[y]);
+    }
+
+    bool sameAsAbove(int x, int y) const {
+        return (_above[y * _words + x / 64] >> (x % 64) & 1) != 0;
+    }
+
+    // Calls f with each column x0 <= x < x1 on row y equal to the pixel above
+    template <typename F>
+    void forEachSameAsAbove(int y, int x0, int x1, F f) const {
+        for (int word = x0 / 64; word * 64 < x1; word++) {
+            auto bits = _above[y * _words + word];
+            if (word == x0 / 64) {
+                bits &= ~0ull << (x0 % 64);
+            }
+            while (bits != 0) {
+                const int x = word * 64 + std::countr_zero(bits);
+                if (x >= x1) {
+                    return;
+                }
+                f(x);
+                bits &= bits - 1;
+            }
+        }
+    }
+
+   private:
+    int _width;
+    int _height;
+    int _words;
+    std::vector<PixelRun> _runs;
+    std::vector<size_t> _rowStarts;
+    std::vector<uint64_t> _above;
+};
+
 struct Line {
+    using allocator_type = std::pmr::polymorphic_allocator<>;
+
+    explicit Line(const allocator_type& allocator = {}) : _points(allocator) {
+    }
+
+    Line(const Line& other, const allocator_type& allocator = {}) : _points(other._points, allocator) {
+    }
+
+    Line(Line&& other) = default;
+
+    Line(Line&& other, const allocator_type& allocator) : _points(std::move(other._points), allocator) {
+    }
+
+    Line& operator=(const Line& other) = default;
+    Line& operator=(Line&& other) = default;
+
     void add(const Point& p) {
         _points.push_back(p);
     }
@@ -43,17 +110,78 @@ struct Line {
     void optimize();
 
    private:
-    std::vector<Point> _points;
+    std::pmr::vector<Point> _points;
 };
 
 using PixelAreaID = std::pair<int, int>;
 
+struct PatternStamp {
+    uint8_t flags;
+    Point position;
+};
+
+enum AreaFlags : uint8_t {
+    areaSinglePixel = 1 << 0,
+    areaFilled = 1 << 1,
+    // Set while placing, when fills or patterns made the outline unnecessary
+    areaNoLines = 1 << 2,
+    // Set while placing, when lines and fills were cheaper than patterns
+    areaNoPatterns = 1 << 3,
+};
+
 struct PixelArea {
-    PixelArea(int row, int start, uint8_t color) : _top(row), _color(color) {
-        _runs.push_back(PixelRun(row, start, 1, color));
+    using allocator_type = std::pmr::polymorphic_allocator<>;
+
+    PixelArea(const PixelRun& run, const allocator_type& allocator = {}) : PixelArea(allocator) {
+        _top = run.row;
+        _color = run.color;
+        _runs.push_back(run);
+    }
+
+    // Rebuilds an area from stored runs, all of the area color
+    PixelArea(int top, uint8_t color, std::span<const PixelRun> runs, const allocator_type& allocator = {})
+        : PixelArea(allocator) {
+        _top = top;
+        _color = color;
+        _runs.assign(runs.begin(), runs.end());
     }
 
-    PixelArea() = default;
+    explicit PixelArea(const allocator_type& allocator = {})
+        : _runs(allocator), _lines(allocator), _pixels(allocator), _fills(allocator), _patterns(allocator) {
+    }
+
+    PixelArea(const PixelArea& other, const allocator_type& allocator = {})
+        : _top(other._top),
+          _color(other._color),
+          _runs(other._runs, allocator),
+          _lines(other._lines, allocator),
+          _pixels(other._pixels, allocator),
+          _fills(other._fills, allocator),
+          _patterns(other._patterns, allocator),
+          _closed(other._closed),
+          _flags(other._flags) {
+    }
+
+    PixelArea(PixelArea&& other) = default;
+
+    PixelArea(PixelArea&& other, const allocator_type& allocator)
+        : _top(other._top),
+          _color(other._color),
+          _runs(std::move(other._runs), allocator),
+          _lines(std::move(other._lines), allocator),
+          _pixels(std::move(other._pixels), allocator),
+          _fills(std::move(other._fills), allocator),
+          _patterns(std::move(other._patterns), allocator),
+          _closed(other._closed),
+          _flags(other._flags) {
+    }
+
+    PixelArea& operator=(const PixelArea& other) = default;
+    PixelArea& operator=(PixelArea&& other) = default;
+
+    allocator_type get_allocator() const {
+        return _runs.get_allocator();
+    }
 
     bool contains(int x, int y) const {
         for (const auto& run : _runs) {
@@ -73,11 +201,6 @@ struct PixelArea {
 
     bool solid() const;
 
-    void extendLastRunTo(int column) {
-        assert(!_runs.empty());
-        _runs.back().extendTo(column);
-    }
-
     void merge(PixelArea& other) {
         assert(this != &other);
         assert(!other.empty());
@@ -86,6 +209,13 @@ struct PixelArea {
         _runs.splice(_runs.end(), other._runs);
     }
 
+    void recolor(uint8_t color) {
+        _color = color;
+        for (auto& run : _runs) {
+            run.color = color;
+        }
+    }
+
     void sort() {
         _runs.sort([](const PixelRun& a, const PixelRun& b) {
             return a.row == b.row ? a.start - b.start : a.row - b.row;
@@ -107,15 +237,50 @@ struct PixelArea {
     }
 
     void fillWithLines();
-    void traceLines(const ByteImage& source);
+    void traceLines(int width, int height);
     void optimizeLines();
     void setPixels(const std::list<Point>& pixels) {
         assert(_pixels.empty());
         _pixels.insert(_pixels.end(), pixels.begin(), pixels.end());
     }
-    void findFills(PaletteImage& canvas, uint8_t bg);
+    template <typename Canvas>
+    void findFills(Canvas& canvas, uint8_t bg);
+    bool coverWithPatterns(int width, int height);
+    template <typename Canvas>
+    void usePatterns(Canvas& canvas);
+    void clearPatterns() {
+        setFlag(areaNoPatterns);
+    }
+    void resetPlacement() {
+        _flags &= ~(areaNoLines | areaNoPatterns);
+        _fills.clear();
+    }
+
+    // The outcome of placing the area, for comparing placements in different orders
+    struct Placement {
+        uint8_t flags;
+        std::vector<Point> fills;
+    };
+
+    Placement placement() const {
+        return { uint8_t(_flags & (areaNoLines | areaNoPatterns)), { _fills.begin(), _fills.end() } };
+    }
+
+    void restorePlacement(const Placement& placement) {
+        resetPlacement();
+        _flags |= placement.flags;
+        _fills.assign(placement.fills.begin(), placement.fills.end());
+    }
+
+    bool hasFlag(AreaFlags flag) const {
+        return (_flags & flag) != 0;
+    }
 
-    const std::list<PixelRun>& runs() const {
+    void setFlag(AreaFlags flag) {
+        _flags |= flag;
+    }
+
+    const std::pmr::list<PixelRun>& runs() const {
         return _runs;
     }
 
@@ -129,7 +294,7 @@ struct PixelArea {
     }
 
     std::span<const Line> lines() const {
-        return _lines;
+        return hasFlag(areaNoLines) ? std::span<const Line>() : std::span(_lines);
     }
 
     std::span<const Point> fills() const {
@@ -140,36 +305,112 @@ struct PixelArea {
         return _pixels;
     }
 
+    std::span<const PatternStamp> patterns() const {
+        return hasFlag(areaNoPatterns) ? std::span<const PatternStamp>() : std::span(_patterns);
+    }
+
    private:
     int _top{ 0 };
-    std::uint8_t _color;
-    std::list<PixelRun> _runs;
-    std::vector<Line> _lines;
-    std::vector<Point> _pixels;
-    std::vector<Point> _fills;
+    std::uint8_t _color{ 0 };
+    std::pmr::list<PixelRun> _runs;
+    std::pmr::vector<Line> _lines;
+    std::pmr::vector<Point> _pixels;
+    std::pmr::vector<Point> _fills;
+    std::pmr::vector<PatternStamp> _patterns;
     bool _closed{ false };
+    uint8_t _flags{ 0 };
 };
 
-using PixelRunList = std::vector<PixelRun>;
+struct VectorizerOptions {
+    // Local search moves spent on the area draw order, 0 keeps the palette order
+    int orderBudget{ 64 };
+    // Horizontal bands labeled in parallel and stitched at the seams, 1 labels the image as a whole
+    int tiles{ 1 };
+};
+
+// What a scan leaves behind for rescanning an edited version of its image
+template <typename Size>
+struct BasicScanState {
+    bool empty() const {
+        return !source;
+    }
 
-struct SCIPicVectorizer {
-    SCIPicVectorizer(const EGAImage& bmp)
-        : _source(bmp), _colors(buildPalette(bmp)), _paletteImage(bmp.width(), bmp.height()) {
+    std::optional<BasicEGAImage<Size>> source;
+    std::vector<PaletteColor> colors;
+    // Before equivalent areas were merged into it
+    std::optional<BasicByteImage<Size>> paletteImage;
+    // Labeled and traced, before ordering and placement
+    std::pmr::vector<PixelArea> areas;
+};
+
+template <typename Size>
+struct BasicSCIPicVectorizer {
+    using SourceImage = BasicEGAImage<Size>;
+    using Canvas = BasicPaletteImage<Size>;
+    using ScanState = BasicScanState<Size>;
+
+    // Areas are allocated from the given arena, or one owned by the vectorizer.
+    // With stages, the palette and the labeled areas are loaded when the source was seen before.
+    BasicSCIPicVectorizer(const SourceImage& bmp, const VectorizerOptions& options = {}, Arena* arena = nullptr,
+        const StageStore* stages = nullptr)
+        : _source(bmp),
+          _options(options),
+          _stages(stages),
+          _sourceKey(stages != nullptr ? sourceKey(bmp) : 0),
+          _colors(stagedPalette(bmp, stages, _sourceKey)),
+          _paletteImage(bmp.width(), bmp.height()),
+          _ownArena(arena == nullptr ? std::make_unique<Arena>() : nullptr),
+          _arena(arena != nullptr ? *arena : *_ownArena),
+          _areas(&_arena) {
     }
 
-    void scan();
+    // With a state left by scanning an earlier version of the image, only the palette
+    // image rows and the areas that changed are redone, returning true. The state is
+    // replaced by this scan's.
+    bool scan(ScanState* state = nullptr);
     std::vector<SCICommand> encode() const;
     PixelArea* areaAt(int x, int y);
 
    private:
     int pickColor(int x, int y, int previousColor, std::span<const uint8_t> previousRow) const;
     void createPaletteImage();
-    void scanRow(int y, std::vector<PixelAreaID>& columnAreas);
+    bool continueFrom(const ScanState& state);
+    void updatePaletteImage(const ScanState& previous);
+    using Areas = std::pmr::vector<PixelArea>;
+    // Indices into the areas, in drawing order
+    using DrawOrder = std::vector<size_t>;
+
+    static uint64_t sourceKey(const SourceImage& bmp);
+    static Palette stagedPalette(const SourceImage& bmp, const StageStore* stages, uint64_t key);
+    void writeAreas(StageWriter& writer) const;
+    void readAreas(StageReader& reader);
+
+    void labelAreas();
+    void scanRow(const RunImage& runs, int y, int top, std::vector<size_t>& columnAreas, Areas& areas) const;
+    void mergeEquivalentAreas();
+    void mergeSinglePixelAreas(const DrawOrder& order);
+    void orderAreas(DrawOrder& order) const;
+    void placeAreas(const DrawOrder& order);
+    template <typename Target>
+    void placeArea(PixelArea& area, Target& canvas, bool fill);
+
+    const SourceImage& _source;
+    const VectorizerOptions _options;
+    const StageStore* _stages;
+    // Hash of the source image, which the keys of all stages derive from
+    const uint64_t _sourceKey;
+    Palette _colors;
+    BasicByteImage<Size> _paletteImage;
+
+    // Holds all areas and their geometry, released with the vectorizer when owned
+    std::unique_ptr<Arena> _ownArena;
+    Arena& _arena;
+    Areas _areas;
+    DrawOrder _order;
+};
 
-    const EGAImage& _source;
-    const Palette _colors;
-    ByteImage _paletteImage;
+using ScanState = BasicScanState<PicExtent>;
+using DynamicScanState = BasicScanState<DynamicExtent>;
 
-    std::map<PixelAreaID, PixelArea> _areaMap;
-    std::list<PixelArea> _sortedAreas;
-};
+using SCIPicVectorizer = BasicSCIPicVectorizer<PicExtent>;
+using DynamicSCIPicVectorizer = BasicSCIPicVectorizer<DynamicExtent>;
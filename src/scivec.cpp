@@ -0,0 +1,135 @@
+#include "scivec.hpp"
+#include "scipicparser.hpp"
+#include "scipicencoder.hpp"
+#include "hash.hpp"
+
+#include <algorithm>
+#include <optional>
+
+EGAImage mapToEGA(const RGBAView& image, const StageStore* stages) {
+    if (stages == nullptr) {
+        return EGAImage(picWidth, picHeight, image);
+    }
+
+    // Only the pixels that end up in the picture count
+    const int width = std::min(image.width, picWidth);
+    const int height = std::min(image.height, picHeight);
+    Hash hash;
+    hash.add(stageVersion).add(width).add(height);
+    for (int y = 0; y < height; y++) {
+        const auto* row = reinterpret_cast<const uint8_t*>(image.pixels + y * image.stride);
+        hash.add(std::span(row, width * sizeof(Pixel)));
+    }
+
+    std::optional<EGAImage> ega;
+    memoizeStage(
+        stages,
+        "ega",
+        hash.value(),
+        [&](StageReader& reader) {
+            EGAImage loaded(picWidth, picHeight);
+            readStage(reader, loaded);
+            ega.emplace(loaded);
+        },
+        [&]() {
+            ega.emplace(picWidth, picHeight, image);
+        },
+        [&](StageWriter& writer) {
+            writeStage(writer, *ega);
+        });
+    return *ega;
+}
+
+Conversion Converter::convert(const RGBAView& image, const ConvertOptions& options) {
+    return convert(mapToEGA(image, _stages), options);
+}
+
+Conversion Converter::convert(const EGAImage& image, const ConvertOptions& options) {
+    return vectorize(image, options, nullptr);
+}
+
+Conversion Converter::convert(const EGAImage& image, const ConvertOptions& options, ScanState& state) {
+    if (state.empty()) {
+        return vectorize(image, options, &state);
+    }
+
+    auto verified = options;
+    verified.verify = true;
+    auto conversion = vectorize(image, verified, &state);
+
+    if (conversion.report.incremental && conversion.report.verification == Verification::failed) {
+        state = ScanState();
+        conversion = vectorize(image, options, &state);
+    }
+    return conversion;
+}
+
+Conversion Converter::vectorize(const EGAImage& image, const ConvertOptions& options, ScanState* state) {
+    // Released up front, so a failed conversion leaves nothing behind for the next one
+    _arena.release();
+
+    Conversion conversion;
+    std::vector<SCICommand> commands;
+    {
+        SCIPicVectorizer vec(image, options.vectorizer, &_arena, _stages);
+        conversion.report.incremental = vec.scan(state);
+        commands = vec.encode();
+    }
+
+    conversion.pic = picData(commands);
+    conversion.report.commands = commands.size();
+    conversion.report.size = encodedSize(commands);
+
+    if (options.verify) {
+        const bool same = render(conversion.pic) == image;
+        conversion.report.verification = same ? Verification::passed : Verification::failed;
+    }
+
+    return conversion;
+}
+
+ConverterPool::Lease ConverterPool::borrow() {
+    std::unique_ptr<Converter> converter;
+    {
+        std::lock_guard lock(_lock);
+        if (!_idle.empty()) {
+            converter = std::move(_idle.back());
+            _idle.pop_back();
+        }
+    }
+    if (converter == nullptr) {
+        converter = std::make_unique<Converter>(_stages);
+    }
+    return Lease(*this, std::move(converter));
+}
+
+void ConverterPool::giveBack(std::unique_ptr<Converter> converter) {
+    std::lock_guard lock(_lock);
+    _idle.push_back(std::move(converter));
+}
+
+Conversion convert(const RGBAView& image, const ConvertOptions& options) {
+    return Converter().convert(image, options);
+}
+
+Conversion convert(const EGAImage& image, const ConvertOptions& options) {
+    return Converter().convert(image, options);
+}
+
+EGAImage render(std::span<const uint8_t> pic) {
+    SCIPicParser parser(pic);
+    parser.parse();
+    return parser.image();
+}
+
+std::vector<uint8_t> picData(std::span<const SCICommand> commands) {
+    std::vector<uint8_t> sciData{ 0x81, 0x00 };
+
+    for (const auto& command : commands) {
+        sciData.push_back(command.code);
+        sciData.insert(sciData.end(), command.params.begin(), command.params.end());
+    }
+
+    sciData.push_back(SCICommandCode::pictureEnd);
+    return sciData;
+}
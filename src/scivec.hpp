@@ -0,0 +1,123 @@
+#pragma once
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <span>
+#include <vector>
+
+#include "arena.hpp"
+#include "pixel.hpp"
+#include "image.hpp"
+#include "scipic.hpp"
+#include "scipicvectorizer.hpp"
+#include "stages.hpp"
+
+// In-memory conversion, for use without windowing or files
+
+// Bumped whenever the same input and options may convert differently, which
+// invalidates cached conversions
+constexpr uint32_t converterVersion = 1;
+
+struct ConvertOptions {
+    VectorizerOptions vectorizer;
+    // Render the result and compare it to the input
+    bool verify{ true };
+};
+
+enum class Verification {
+    skipped,
+    passed,
+    failed,
+};
+
+struct ConversionReport {
+    size_t commands{ 0 };
+    size_t size{ 0 };
+    Verification verification{ Verification::skipped };
+    // Made from the state of an earlier conversion
+    bool incremental{ false };
+};
+
+struct Conversion {
+    std::vector<uint8_t> pic;
+    ConversionReport report;
+};
+
+// Converts images one at a time, keeping its memory warm between conversions.
+// Use one converter per thread. Stages, if given, are loaded and stored as the
+// conversions go.
+struct Converter {
+    explicit Converter(const StageStore* stages = nullptr) : _stages(stages) {
+    }
+
+    Conversion convert(const RGBAView& image, const ConvertOptions& options = {});
+    Conversion convert(const EGAImage& image, const ConvertOptions& options = {});
+
+    // Converts an edited version of the image that state was left by, redoing only what
+    // the edit changed, and leaves the new state. Incremental results are always verified,
+    // falling back to a full conversion when they fail.
+    Conversion convert(const EGAImage& image, const ConvertOptions& options, ScanState& state);
+
+   private:
+    Conversion vectorize(const EGAImage& image, const ConvertOptions& options, ScanState* state);
+
+    const StageStore* _stages;
+    Arena _arena;
+};
+
+// Converters for conversions running concurrently. Each conversion borrows an idle
+// converter, so there are only as many converters as conversions at once, and their
+// arenas are reused from one conversion to the next.
+struct ConverterPool {
+    explicit ConverterPool(const StageStore* stages = nullptr) : _stages(stages) {
+    }
+
+    // Holds a converter until destroyed, which gives it back to the pool
+    struct Lease {
+        Lease(ConverterPool& pool, std::unique_ptr<Converter> converter)
+            : _pool(pool), _converter(std::move(converter)) {
+        }
+        ~Lease() {
+            _pool.giveBack(std::move(_converter));
+        }
+
+        Lease(const Lease&) = delete;
+        Lease& operator=(const Lease&) = delete;
+
+        Converter& operator*() const {
+            return *_converter;
+        }
+        Converter* operator->() const {
+            return _converter.get();
+        }
+
+       private:
+        ConverterPool& _pool;
+        std::unique_ptr<Converter> _converter;
+    };
+
+    Lease borrow();
+
+   private:
+    void giveBack(std::unique_ptr<Converter> converter);
+
+    const StageStore* _stages;
+    std::mutex _lock;
+    std::vector<std::unique_ptr<Converter>> _idle;
+};
+
+// Maps the upper left 320x190 pixels of the image to EGA colors, padded with black if
+// smaller. With stages, the mapping is loaded when the same pixels were mapped before.
+EGAImage mapToEGA(const RGBAView& image, const StageStore* stages = nullptr);
+
+// Converts the upper left 320x190 pixels of the image, padded with black if smaller
+Conversion convert(const RGBAView& image, const ConvertOptions& options = {});
+
+// Converts an image already mapped to EGA colors
+Conversion convert(const EGAImage& image, const ConvertOptions& options = {});
+
+// Renders a picture resource
+EGAImage render(std::span<const uint8_t> pic);
+
+// Serializes commands to a picture resource
+std::vector<uint8_t> picData(std::span<const SCICommand> commands);
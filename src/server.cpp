@@ -0,0 +1,316 @@
+#include "server.hpp"
+#include "scivec.hpp"
+#include "parallel.hpp"
+
+#include <cerrno>
+#include <charconv>
+#include <chrono>
+#include <condition_variable>
+#include <cstdio>
+#include <cstring>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+
+#ifndef _WIN32
+#include <csignal>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+#endif
+
+namespace {
+
+// Frames larger than this are taken as a broken stream
+constexpr uint32_t maxFrameSize = 64 << 20;
+
+// Pause before accepting again when out of descriptors or memory
+constexpr std::chrono::milliseconds acceptBackoff(100);
+
+#ifndef _WIN32
+
+// A stream that responses are written to, closed when the last request using it is done
+struct Connection {
+    Connection(int in, int out) : in(in), out(out) {
+    }
+
+    ~Connection() {
+        close(in);
+        if (out != in) {
+            close(out);
+        }
+    }
+
+    bool read(void* data, size_t size) {
+        auto* bytes = static_cast<uint8_t*>(data);
+        while (size > 0) {
+            const auto count = ::read(in, bytes, size);
+            if (count <= 0) {
+                return false;
+            }
+            bytes += count;
+            size -= count;
+        }
+        return true;
+    }
+
+    void write(std::span<const uint8_t> data) {
+        std::lock_guard lock(writeLock);
+        while (!data.empty()) {
+            const auto count = ::write(out, data.data(), data.size());
+            if (count <= 0) {
+                // The client is gone, there is nobody left to tell
+                return;
+            }
+            data = data.subspan(count);
+        }
+    }
+
+    const int in;
+    const int out;
+    std::mutex writeLock;
+};
+
+struct Request {
+    std::shared_ptr<Connection> connection;
+    uint32_t id;
+    std::string options;
+    std::vector<uint8_t> image;
+};
+
+uint32_t readWord(std::span<const uint8_t> bytes) {
+    return bytes[0] | bytes[1] << 8 | bytes[2] << 16 | uint32_t(bytes[3]) << 24;
+}
+
+void appendWord(std::vector<uint8_t>& bytes, uint32_t word) {
+    for (int shift = 0; shift < 32; shift += 8) {
+        bytes.push_back(uint8_t(word >> shift));
+    }
+}
+
+ConvertOptions parseOptions(std::string_view text) {
+    ConvertOptions options;
+
+    const auto intValue = [](std::string_view flag, std::string_view value) {
+        int result = 0;
+        const auto [end, error] = std::from_chars(value.data(), value.data() + value.size(), result);
+        if (error != std::errc() || end != value.data() + value.size()) {
+            throw std::runtime_error("Invalid value for " + std::string(flag));
+        }
+        return result;
+    };
+
+    while (!text.empty()) {
+        const auto end = std::min(text.find(' '), text.size());
+        const auto flag = text.substr(0, end);
+        text.remove_prefix(std::min(end + 1, text.size()));
+
+        if (flag.empty()) {
+            continue;
+        }
+        if (flag == "-noverify") {
+            options.verify = false;
+        } else if (flag.starts_with("-orderbudget=")) {
+            options.vectorizer.orderBudget = intValue(flag, flag.substr(13));
+        } else if (flag.starts_with("-tiles=")) {
+            options.vectorizer.tiles = intValue(flag, flag.substr(7));
+        } else {
+            throw std::runtime_error("Unknown option " + std::string(flag));
+        }
+    }
+
+    return options;
+}
+
+void respond(Connection& connection, uint32_t id, ServeStatus status, uint32_t commands, uint32_t micros,
+    std::span<const uint8_t> data) {
+    std::vector<uint8_t> frame;
+    appendWord(frame, uint32_t(4 * sizeof(uint32_t) + data.size()));
+    appendWord(frame, id);
+    appendWord(frame, uint32_t(status));
+    appendWord(frame, commands);
+    appendWord(frame, micros);
+    frame.insert(frame.end(), data.begin(), data.end());
+    connection.write(frame);
+}
+
+void handle(Converter& converter, const Request& request) {
+    const auto start = std::chrono::steady_clock::now();
+    const auto elapsed = [&start]() {
+        const auto duration = std::chrono::steady_clock::now() - start;
+        return uint32_t(std::chrono::duration_cast<std::chrono::microseconds>(duration).count());
+    };
+
+    try {
+        const auto options = parseOptions(request.options);
+        const ImageFile image(request.image);
+        const auto conversion = converter.convert(image.view(), options);
+
+        auto status = ServeStatus::unverified;
+        if (conversion.report.verification == Verification::passed) {
+            status = ServeStatus::verified;
+        } else if (conversion.report.verification == Verification::failed) {
+            status = ServeStatus::verificationFailed;
+        }
+        const auto commands = uint32_t(conversion.report.commands);
+        respond(*request.connection, request.id, status, commands, elapsed(), conversion.pic);
+    } catch (const std::exception& e) {
+        const std::string_view message(e.what());
+        respond(*request.connection,
+            request.id,
+            ServeStatus::error,
+            0,
+            elapsed(),
+            std::span(reinterpret_cast<const uint8_t*>(message.data()), message.size()));
+    }
+}
+
+// Hands requests to the shared scheduler, converting each with a converter from the pool
+struct Dispatcher : std::enable_shared_from_this<Dispatcher> {
+    void dispatch(Request request) {
+        {
+            std::lock_guard lock(_lock);
+            _pending++;
+        }
+        // Requests in flight keep the dispatcher, which may outlive a failing server
+        spawn([self = shared_from_this(), request = std::move(request)]() {
+            handle(*self->_converters.borrow(), request);
+            {
+                std::lock_guard lock(self->_lock);
+                self->_pending--;
+            }
+            self->_done.notify_all();
+        });
+    }
+
+    // Waits until every dispatched request is answered
+    void wait() {
+        std::unique_lock lock(_lock);
+        _done.wait(lock, [this]() {
+            return _pending == 0;
+        });
+    }
+
+   private:
+    ConverterPool _converters;
+    std::mutex _lock;
+    std::condition_variable _done;
+    size_t _pending{ 0 };
+};
+
+// Reads requests until the stream ends or breaks
+void readRequests(const std::shared_ptr<Connection>& connection, Dispatcher& dispatcher) {
+    while (true) {
+        uint8_t header[4];
+        if (!connection->read(header, sizeof(header))) {
+            return;
+        }
+        const auto length = readWord(header);
+        if (length < 8 || length > maxFrameSize) {
+            fprintf(stderr, "Dropping connection, bad frame length %u\n", length);
+            return;
+        }
+
+        std::vector<uint8_t> frame(length);
+        if (!connection->read(frame.data(), frame.size())) {
+            return;
+        }
+
+        const std::span<const uint8_t> bytes(frame);
+        const auto optionsLength = readWord(bytes.subspan(4));
+        if (optionsLength > length - 8) {
+            fprintf(stderr, "Dropping connection, bad options length %u\n", optionsLength);
+            return;
+        }
+
+        const auto options = bytes.subspan(8, optionsLength);
+        const auto image = bytes.subspan(8 + optionsLength);
+        dispatcher.dispatch(Request{
+            connection, readWord(bytes), std::string(options.begin(), options.end()), { image.begin(), image.end() } });
+    }
+}
+
+#endif
+
+}  // namespace
+
+#ifndef _WIN32
+
+void serveStdio() {
+    signal(SIGPIPE, SIG_IGN);
+
+    // Responses get stdout to themselves, anything else printed goes to stderr
+    const int out = dup(STDOUT_FILENO);
+    dup2(STDERR_FILENO, STDOUT_FILENO);
+
+    const auto dispatcher = std::make_shared<Dispatcher>();
+    readRequests(std::make_shared<Connection>(dup(STDIN_FILENO), out), *dispatcher);
+    dispatcher->wait();
+}
+
+void serveSocket(std::string_view path) {
+    signal(SIGPIPE, SIG_IGN);
+
+    sockaddr_un address{};
+    address.sun_family = AF_UNIX;
+    if (path.size() >= sizeof(address.sun_path)) {
+        throw std::runtime_error("Socket path too long");
+    }
+    std::memcpy(address.sun_path, path.data(), path.size());
+
+    const int listener = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (listener < 0) {
+        throw std::runtime_error("Failed to create socket");
+    }
+    unlink(address.sun_path);
+    if (bind(listener, reinterpret_cast<const sockaddr*>(&address), sizeof(address)) != 0 || listen(listener, 16) != 0) {
+        close(listener);
+        throw std::runtime_error("Failed to listen on socket");
+    }
+
+    const auto dispatcher = std::make_shared<Dispatcher>();
+
+    fprintf(stderr, "Serving on %s\n", address.sun_path);
+
+    // Set while accepting fails for lack of resources, to report it once
+    bool starved = false;
+    while (true) {
+        const int client = accept(listener, nullptr, nullptr);
+        if (client < 0) {
+            if (errno == EINTR || errno == ECONNABORTED || errno == EPROTO) {
+                continue;
+            }
+            if (errno == EMFILE || errno == ENFILE || errno == ENOBUFS || errno == ENOMEM) {
+                // Out of descriptors or memory until connections in flight are done
+                if (!starved) {
+                    fprintf(stderr, "Failed to accept connection: %s\n", strerror(errno));
+                    starved = true;
+                }
+                std::this_thread::sleep_for(acceptBackoff);
+                continue;
+            }
+            close(listener);
+            throw std::runtime_error(std::string("Failed to accept connections: ") + strerror(errno));
+        }
+        starved = false;
+        // Readers only wait for input, so they get threads of their own outside the scheduler
+        std::thread([connection = std::make_shared<Connection>(client, client), dispatcher]() {
+            readRequests(connection, *dispatcher);
+        }).detach();
+    }
+}
+
+#else
+
+void serveStdio() {
+    throw std::runtime_error("Serving is not supported on this platform");
+}
+
+void serveSocket(std::string_view path) {
+    throw std::runtime_error("Serving is not supported on this platform");
+}
+
+#endif
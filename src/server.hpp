@@ -0,0 +1,22 @@
+#pragma once
+#include <string_view>
+
+// Conversion server, answering length-prefixed requests either on stdin and stdout,
+// or on connections to a Unix domain socket. Requests are converted concurrently as
+// tasks on the shared scheduler, with converters kept warm between requests.
+//
+// All integers are 32 bit little-endian. A request is
+//     length of the rest, id, options length, options, image file bytes
+// where options are command line flags separated by spaces. A response is
+//     length of the rest, id, status, commands, microseconds, data
+// with data holding the picture resource, or an error message for status error.
+
+enum class ServeStatus {
+    verified = 0,
+    unverified = 1,
+    verificationFailed = 2,
+    error = 3,
+};
+
+void serveStdio();
+void serveSocket(std::string_view path);
@@ -0,0 +1,83 @@
+#include "stages.hpp"
+
+namespace {
+
+void readExtent(StageReader& reader, int width, int height) {
+    const int storedWidth = reader.u16();
+    const int storedHeight = reader.u16();
+    if (storedWidth != width || storedHeight != height) {
+        throw std::runtime_error("Stage image size mismatch");
+    }
+}
+
+}  // namespace
+
+template <typename Size>
+void writeStage(StageWriter& writer, const BasicNibbleImage<Size>& image) {
+    writer.u16(uint16_t(image.width()));
+    writer.u16(uint16_t(image.height()));
+    for (int y = 0; y < image.height(); y++) {
+        writer.bytes(image.packedRow(y));
+    }
+}
+
+template <typename Size>
+void readStage(StageReader& reader, BasicNibbleImage<Size>& image) {
+    readExtent(reader, image.width(), image.height());
+    for (int y = 0; y < image.height(); y++) {
+        const auto row = reader.bytes(image.stride());
+        for (int x = 0; x < image.width(); x++) {
+            const auto pair = row[x / 2];
+            image.put(x, y, (x & 1) != 0 ? pair >> 4 : pair & 0x0f);
+        }
+    }
+}
+
+template <typename Size>
+void writeStage(StageWriter& writer, const BasicByteImage<Size>& image) {
+    writer.u16(uint16_t(image.width()));
+    writer.u16(uint16_t(image.height()));
+    for (int y = 0; y < image.height(); y++) {
+        writer.bytes(image.row(y));
+    }
+}
+
+template <typename Size>
+void readStage(StageReader& reader, BasicByteImage<Size>& image) {
+    readExtent(reader, image.width(), image.height());
+    for (int y = 0; y < image.height(); y++) {
+        const auto row = reader.bytes(image.width());
+        for (int x = 0; x < image.width(); x++) {
+            image.put(x, y, row[x]);
+        }
+    }
+}
+
+void writeStage(StageWriter& writer, const Palette& palette) {
+    const auto colors = palette.colors();
+    writer.u8(uint8_t(colors.size()));
+    for (const auto& color : colors) {
+        writer.u8(uint8_t(color.first << 4 | color.second));
+    }
+}
+
+Palette readPalette(StageReader& reader) {
+    const auto count = reader.u8();
+    if (count > maxColors) {
+        throw std::runtime_error("Bad stage palette");
+    }
+    std::vector<PaletteColor> colors;
+    for (const auto pair : reader.bytes(count)) {
+        colors.emplace_back(pair >> 4, pair & 0x0f);
+    }
+    return Palette(colors);
+}
+
+template void writeStage(StageWriter& writer, const NibbleImage& image);
+template void writeStage(StageWriter& writer, const DynamicNibbleImage& image);
+template void readStage(StageReader& reader, NibbleImage& image);
+template void readStage(StageReader& reader, DynamicNibbleImage& image);
+template void writeStage(StageWriter& writer, const ByteImage& image);
+template void writeStage(StageWriter& writer, const DynamicByteImage& image);
+template void readStage(StageReader& reader, ByteImage& image);
+template void readStage(StageReader& reader, DynamicByteImage& image);
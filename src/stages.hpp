@@ -0,0 +1,130 @@
+#pragma once
+#include <cstdint>
+#include <optional>
+#include <span>
+#include <stdexcept>
+#include <string_view>
+#include <vector>
+
+#include "image.hpp"
+#include "palette.hpp"
+
+// Intermediate products of a conversion, serialized so that later conversions of the
+// same input can skip the stages that made them. Each product is keyed by the hash
+// of the products it was made from, and the options that affect it.
+
+// Bumped whenever a stage's product or its serialization changes
+constexpr uint32_t stageVersion = 1;
+
+struct StageStore {
+    virtual std::optional<std::vector<uint8_t>> loadStage(std::string_view stage, uint64_t key) const = 0;
+    virtual void storeStage(std::string_view stage, uint64_t key, std::span<const uint8_t> data) const = 0;
+
+   protected:
+    ~StageStore() = default;
+};
+
+// Little-endian serialization of stage products
+struct StageWriter {
+    void u8(uint8_t value) {
+        _data.push_back(value);
+    }
+
+    void u16(uint16_t value) {
+        u8(uint8_t(value));
+        u8(uint8_t(value >> 8));
+    }
+
+    void u32(uint32_t value) {
+        u16(uint16_t(value));
+        u16(uint16_t(value >> 16));
+    }
+
+    void bytes(std::span<const uint8_t> bytes) {
+        _data.insert(_data.end(), bytes.begin(), bytes.end());
+    }
+
+    std::span<const uint8_t> data() const {
+        return _data;
+    }
+
+   private:
+    std::vector<uint8_t> _data;
+};
+
+// Reads what a StageWriter wrote, throwing on data that does not fit
+struct StageReader {
+    explicit StageReader(std::span<const uint8_t> data) : _data(data) {
+    }
+
+    uint8_t u8() {
+        return bytes(1)[0];
+    }
+
+    uint16_t u16() {
+        const auto low = u8();
+        return low | u8() << 8;
+    }
+
+    uint32_t u32() {
+        const auto low = u16();
+        return low | uint32_t(u16()) << 16;
+    }
+
+    std::span<const uint8_t> bytes(size_t count) {
+        if (count > _data.size()) {
+            throw std::runtime_error("Truncated stage data");
+        }
+        const auto bytes = _data.first(count);
+        _data = _data.subspan(count);
+        return bytes;
+    }
+
+    void finish() const {
+        if (!_data.empty()) {
+            throw std::runtime_error("Trailing stage data");
+        }
+    }
+
+   private:
+    std::span<const uint8_t> _data;
+};
+
+// Reads the stored product of a stage when there is one, otherwise makes it and
+// stores what write serializes. Make must redo everything a failed read touched.
+template <typename Read, typename Make, typename Write>
+void memoizeStage(const StageStore* stages, std::string_view stage, uint64_t key, Read read, Make make, Write write) {
+    if (stages != nullptr) {
+        if (const auto data = stages->loadStage(stage, key)) {
+            try {
+                StageReader reader(*data);
+                read(reader);
+                reader.finish();
+                return;
+            } catch (const std::runtime_error&) {
+                // Made again below
+            }
+        }
+    }
+
+    make();
+
+    if (stages != nullptr) {
+        StageWriter writer;
+        write(writer);
+        stages->storeStage(stage, key, writer.data());
+    }
+}
+
+template <typename Size>
+void writeStage(StageWriter& writer, const BasicNibbleImage<Size>& image);
+template <typename Size>
+void readStage(StageReader& reader, BasicNibbleImage<Size>& image);
+
+template <typename Size>
+void writeStage(StageWriter& writer, const BasicByteImage<Size>& image);
+template <typename Size>
+void readStage(StageReader& reader, BasicByteImage<Size>& image);
+
+void writeStage(StageWriter& writer, const Palette& palette);
+Palette readPalette(StageReader& reader);
@@ -0,0 +1,95 @@
+#include "watcher.hpp"
+
+#include <algorithm>
+#include <map>
+#include <stdexcept>
+
+#ifdef __linux__
+#include <poll.h>
+#include <sys/inotify.h>
+#include <unistd.h>
+#endif
+
+#ifdef __linux__
+
+void watchDirectory(const std::filesystem::path& dir, std::chrono::milliseconds debounce,
+    const std::function<void(const std::filesystem::path&)>& changed) {
+    using Clock = std::chrono::steady_clock;
+
+    const int fd = inotify_init1(IN_CLOEXEC);
+    if (fd < 0) {
+        throw std::runtime_error("Failed to start watching");
+    }
+    // Modifications only push the deadline, saving is done at close or rename
+    if (inotify_add_watch(fd, dir.c_str(), IN_MODIFY | IN_CLOSE_WRITE | IN_MOVED_TO | IN_DELETE_SELF) < 0) {
+        close(fd);
+        throw std::runtime_error("Failed to watch directory");
+    }
+
+    std::map<std::filesystem::path, Clock::time_point> pending;
+    alignas(inotify_event) char buffer[4096];
+
+    while (true) {
+        int timeout = -1;
+        if (!pending.empty()) {
+            const auto next = std::min_element(pending.begin(), pending.end(), [](const auto& a, const auto& b) {
+                return a.second < b.second;
+            })->second;
+            const auto wait = std::chrono::ceil<std::chrono::milliseconds>(next - Clock::now());
+            timeout = int(std::max<std::chrono::milliseconds::rep>(wait.count(), 0));
+        }
+
+        pollfd poller{ fd, POLLIN, 0 };
+        if (poll(&poller, 1, timeout) > 0) {
+            const auto length = read(fd, buffer, sizeof(buffer));
+            if (length <= 0) {
+                break;
+            }
+
+            const auto deadline = Clock::now() + debounce;
+            for (char* p = buffer; p < buffer + length;) {
+                const auto* event = reinterpret_cast<const inotify_event*>(p);
+                p += sizeof(inotify_event) + event->len;
+
+                if (event->mask & (IN_DELETE_SELF | IN_IGNORED)) {
+                    close(fd);
+                    throw std::runtime_error("Watched directory was removed");
+                }
+                if (event->mask & IN_Q_OVERFLOW) {
+                    // Events were lost, so anything could have changed
+                    for (const auto& entry : std::filesystem::directory_iterator(dir)) {
+                        if (entry.is_regular_file()) {
+                            pending[entry.path()] = deadline;
+                        }
+                    }
+                    continue;
+                }
+                if (event->len > 0 && !(event->mask & IN_ISDIR)) {
+                    pending[dir / event->name] = deadline;
+                }
+            }
+        }
+
+        const auto now = Clock::now();
+        for (auto it = pending.begin(); it != pending.end();) {
+            if (it->second <= now) {
+                const auto path = it->first;
+                it = pending.erase(it);
+                changed(path);
+            } else {
+                ++it;
+            }
+        }
+    }
+
+    close(fd);
+}
+
+#else
+
+void watchDirectory(const std::filesystem::path& dir, std::chrono::milliseconds debounce,
+    const std::function<void(const std::filesystem::path&)>& changed) {
+    throw std::runtime_error("Watching is not supported on this platform");
+}
+
+#endif
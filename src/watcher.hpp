@@ -0,0 +1,9 @@
+#pragma once
+#include <chrono>
+#include <filesystem>
+#include <functional>
+
+// Watches a directory for files being written or moved in, calling changed for each
+// once it has been left alone for the debounce time. Runs until the directory goes away.
+void watchDirectory(const std::filesystem::path& dir, std::chrono::milliseconds debounce,
+    const std::function<void(const std::filesystem::path&)>& changed);
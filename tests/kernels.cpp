@@ -0,0 +1,12 @@
+#include "kernels.hpp"
+
+#include <cstdio>
+
+// Checks every kernel set this CPU supports against the scalar kernels
+int main() {
+    if (!checkKernels()) {
+        fprintf(stderr, "Kernel check failed\n");
+        return 1;
+    }
+    return 0;
+}